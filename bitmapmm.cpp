@@ -9,213 +9,1190 @@
 
 using namespace std;
 #endif /* __PROGTEST__ */
+#include <atomic>
+#include <pthread.h>
 
 #define UNITSIZE 128
 
-// Number of allocation units available for allocation
-int alloc_units;
-char *bitmap_p;
-int bitmap_size;
-void *mempool_p;
+// Placement strategies of HeapAlloc
+#define FIRST_FIT 0
+#define NEXT_FIT 1
+#define BEST_FIT 2
 
-void   HeapInit    ( void * memPool, int memSize )
+// Number of free runs remembered for BEST_FIT
+#define RUN_CACHE_SIZE 8
+
+// Max number of arenas of arena heap
+#define ARENA_MAX 16
+
+// Size classes of small objects: SLAB_MIN_SIZE << c for c < SLAB_CLASSES
+#define SLAB_MIN_SIZE 8
+#define SLAB_CLASSES 8
+#define SLAB_MAX_SIZE (SLAB_MIN_SIZE << (SLAB_CLASSES - 1))
+// Slab of small objects takes SLAB_UNITS alloc_units
+#define SLAB_UNITS 64
+#define SLAB_MAP_WORDS (SLAB_UNITS * UNITSIZE / SLAB_MIN_SIZE / 64)
+#define SLAB_MAGIC 0x51AB51ABu
+
+// Even ("used") bits of 64-bit bitmap word, the word addresses 32 alloc_units
+#define EVEN_BITS 0x5555555555555555ULL
+
+/*
+	Summary of free alloc_units of bitmap word or of range of words.
+	Summaries form complete binary tree stored after bitmap: node 1 is root,
+	children of node i are 2i and 2i+1, leaves summary_leaves .. 2 * summary_leaves - 1
+	summarize bitmap words 0 .. summary_leaves - 1
+*/
+struct summary {
+	// Free units at the beginning and at the end of range
+	uint32_t prefix;
+	uint32_t suffix;
+	// Longest run of free units in range
+	uint32_t longest;
+};
+
+struct free_run {
+	int start;
+	int length;
+};
+
+/*
+	State of one heap. Several heaps can be used at once,
+	progtest interface HeapInit .. HeapDone uses default_heap
+*/
+struct bitmap_heap {
+	// Number of allocation units available for allocation
+	int alloc_units;
+	char *bitmap_p;
+	int bitmap_size;
+	void *mempool_p;
+
+	struct summary *summary_p;
+	int summary_leaves;
+	int summary_levels;
+
+	// Placement strategy
+	int placement;
+	// NEXT_FIT search starts at this unit
+	int rover;
+
+	/*
+		Free runs known to BEST_FIT. Every entry is free, but not necessarily whole
+		free run: entries are trimmed by mark_units_used and added by heap_free
+	*/
+	struct free_run run_cache[RUN_CACHE_SIZE];
+	int run_cache_size;
+
+	// Live counters maintained by heap_alloc and heap_free
+	int alloc_blocks;
+	int alloc_units_used;
+};
+
+/*
+	Bitmap words are accessed atomically, so that other threads can check
+	start of block without lock of the heap (see arena_free)
+*/
+uint64_t load_word(struct bitmap_heap *h, int word_nr) {
+	return __atomic_load_n((uint64_t *)h->bitmap_p + word_nr, __ATOMIC_RELAXED);
+}
+
+void store_word(struct bitmap_heap *h, int word_nr, uint64_t word) {
+	__atomic_store_n((uint64_t *)h->bitmap_p + word_nr, word, __ATOMIC_RELAXED);
+}
+
+/*
+	Compress even bits of bitmap word into 32-bit mask.
+	Bit k of result is 1 if k-th alloc_unit addressed by word is used
+*/
+uint32_t used_units(uint64_t word) {
+	word &= EVEN_BITS;
+	word = (word | (word >> 1)) & 0x3333333333333333ULL;
+	word = (word | (word >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+	word = (word | (word >> 4)) & 0x00FF00FF00FF00FFULL;
+	word = (word | (word >> 8)) & 0x0000FFFF0000FFFFULL;
+	word = (word | (word >> 16)) & 0x00000000FFFFFFFFULL;
+	return (uint32_t)word;
+}
+
+// Same for odd bits: bit k of result is 1 if k-th alloc_unit is marked as first
+uint32_t first_units(uint64_t word) {
+	return used_units(word >> 1);
+}
+
+/*
+	Args:
+	    used is mask of used units of word
+	    n is required number of free units
+	return value:
+	    first unit of first run of at least n free units inside word or -1
+	Runs are measured with count trailing zeros
+*/
+int find_run_in_word(uint32_t used, int n) {
+	if (used == 0xffffffff) {
+		return -1;
+	}
+	int u = 0;
+	while (u < 32) {
+		uint32_t rest = used >> u;
+		if (rest & 1) {
+			// Skip used units
+			u += __builtin_ctz(~rest);
+			continue;
+		}
+		int len = (rest == 0) ? 32 - u : __builtin_ctz(rest);
+		if (len >= n) {
+			return u;
+		}
+		u += len;
+	}
+	return -1;
+}
+
+// Number of units in range of node
+uint32_t node_units(struct bitmap_heap *h, int node) {
+	return 32u << (h->summary_levels - (31 - __builtin_clz(node)));
+}
+
+// First unit in range of node
+int node_first_unit(struct bitmap_heap *h, int node) {
+	int depth = 31 - __builtin_clz(node);
+	return ((node << (h->summary_levels - depth)) - h->summary_leaves) * 32;
+}
+
+// Mask of used units of bitmap word, words past bitmap are used
+uint32_t leaf_used(struct bitmap_heap *h, int word_nr) {
+	return (word_nr < h->bitmap_size / 8) ? used_units(load_word(h, word_nr)) : 0xffffffff;
+}
+
+// Recompute summary of bitmap word
+void summary_set_leaf(struct bitmap_heap *h, int word_nr) {
+	struct summary *leaf = &h->summary_p[h->summary_leaves + word_nr];
+	uint32_t used = leaf_used(h, word_nr);
+	if (used == 0) {
+		leaf->prefix = leaf->suffix = leaf->longest = 32;
+		return;
+	}
+	if (used == 0xffffffff) {
+		leaf->prefix = leaf->suffix = leaf->longest = 0;
+		return;
+	}
+	leaf->prefix = __builtin_ctz(used);
+	leaf->suffix = __builtin_clz(used);
+	leaf->longest = 0;
+	int u = 0;
+	while (u < 32) {
+		uint32_t rest = used >> u;
+		if (rest & 1) {
+			u += __builtin_ctz(~rest);
+			continue;
+		}
+		uint32_t len = (rest == 0) ? 32 - u : __builtin_ctz(rest);
+		if (len > leaf->longest) {
+			leaf->longest = len;
+		}
+		u += len;
+	}
+}
+
+// Recompute summary of inner node from its children
+void summary_merge(struct bitmap_heap *h, int node) {
+	struct summary *left = &h->summary_p[2 * node];
+	struct summary *right = &h->summary_p[2 * node + 1];
+	uint32_t half = node_units(h, 2 * node);
+	h->summary_p[node].prefix = (left->prefix == half) ? half + right->prefix : left->prefix;
+	h->summary_p[node].suffix = (right->suffix == half) ? half + left->suffix : right->suffix;
+	uint32_t longest = (left->longest > right->longest) ? left->longest : right->longest;
+	if (left->suffix + right->prefix > longest) {
+		longest = left->suffix + right->prefix;
+	}
+	h->summary_p[node].longest = longest;
+}
+
+// Recompute summaries of bitmap words first_word .. last_word and of their ancestors
+void summary_update(struct bitmap_heap *h, int first_word, int last_word) {
+	for (int w = first_word; w <= last_word; w++) {
+		summary_set_leaf(h, w);
+	}
+	int lo = (h->summary_leaves + first_word) / 2;
+	int hi = (h->summary_leaves + last_word) / 2;
+	while (lo > 0) {
+		for (int node = lo; node <= hi; node++) {
+			summary_merge(h, node);
+		}
+		lo /= 2;
+		hi /= 2;
+	}
+}
+
+/*
+	Find first run of n free alloc_units in range of node.
+	Node has to hold such run.
+	Descend from node: go to left child if it holds long enough run,
+	take run crossing middle of node if it is long enough, otherwise go right.
+	return value:
+	    first unit of run
+*/
+int summary_find_in(struct bitmap_heap *h, int node, int n) {
+	while (node < h->summary_leaves) {
+		struct summary *left = &h->summary_p[2 * node];
+		struct summary *right = &h->summary_p[2 * node + 1];
+		if (left->longest >= (uint32_t)n) {
+			node = 2 * node;
+		} else if (left->suffix + right->prefix >= (uint32_t)n) {
+			return node_first_unit(h, 2 * node + 1) - left->suffix;
+		} else {
+			node = 2 * node + 1;
+		}
+	}
+	int word_nr = node - h->summary_leaves;
+	return word_nr * 32 + find_run_in_word(leaf_used(h, word_nr), n);
+}
+
+/*
+	Find first run of n free alloc_units.
+	return value:
+	    first unit of run or -1
+*/
+int summary_find(struct bitmap_heap *h, int n) {
+	if (h->summary_p[1].longest < (uint32_t)n) {
+		return -1;
+	}
+	return summary_find_in(h, 1, n);
+}
+
+/*
+	Find first run of n free alloc_units starting at unit from or later
+	in range of node.
+	return value:
+	    first unit of run or -1
+*/
+int summary_find_from(struct bitmap_heap *h, int node, int n, int from) {
+	int first = node_first_unit(h, node);
+	if (first + (int)node_units(h, node) <= from || h->summary_p[node].longest < (uint32_t)n) {
+		return -1;
+	}
+	if (first >= from) {
+		return summary_find_in(h, node, n);
+	}
+	if (node >= h->summary_leaves) {
+		// Units below from are treated as used
+		uint32_t used = leaf_used(h, node - h->summary_leaves) | ((1u << (from - first)) - 1);
+		int u = find_run_in_word(used, n);
+		return (u == -1) ? -1 : first + u;
+	}
+	int res = summary_find_from(h, 2 * node, n, from);
+	if (res != -1) {
+		return res;
+	}
+	// Run crossing middle, its part below from is not counted
+	int mid = node_first_unit(h, 2 * node + 1);
+	if (mid >= from) {
+		int suffix = h->summary_p[2 * node].suffix;
+		if (suffix > mid - from) {
+			suffix = mid - from;
+		}
+		if (suffix + h->summary_p[2 * node + 1].prefix >= (uint32_t)n) {
+			return mid - suffix;
+		}
+	}
+	return summary_find_from(h, 2 * node + 1, n, from);
+}
+
+/*
+	Remove units start_unit .. start_unit + n - 1 from cached free runs.
+	If run is split, its longer part is kept
+*/
+void run_cache_trim(struct bitmap_heap *h, int start_unit, int n) {
+	int end = start_unit + n;
+	for (int i = 0; i < h->run_cache_size; ) {
+		int run_start = h->run_cache[i].start;
+		int run_end = run_start + h->run_cache[i].length;
+		if (run_end <= start_unit || run_start >= end) {
+			i++;
+			continue;
+		}
+		int left = (start_unit > run_start) ? start_unit - run_start : 0;
+		int right = (run_end > end) ? run_end - end : 0;
+		if (left == 0 && right == 0) {
+			h->run_cache[i] = h->run_cache[--h->run_cache_size];
+			continue;
+		}
+		if (left >= right) {
+			h->run_cache[i].length = left;
+		} else {
+			h->run_cache[i].start = end;
+			h->run_cache[i].length = right;
+		}
+		i++;
+	}
+}
+
+/*
+	Remember free run. Cached runs inside it are dropped,
+	if cache is full, the run replaces the shortest one
+*/
+void run_cache_insert(struct bitmap_heap *h, int start_unit, int n) {
+	int shortest = -1;
+	for (int i = 0; i < h->run_cache_size; ) {
+		if (h->run_cache[i].start >= start_unit &&
+		    h->run_cache[i].start + h->run_cache[i].length <= start_unit + n) {
+			h->run_cache[i] = h->run_cache[--h->run_cache_size];
+			continue;
+		}
+		if (shortest == -1 || h->run_cache[i].length < h->run_cache[shortest].length) {
+			shortest = i;
+		}
+		i++;
+	}
+	if (h->run_cache_size < RUN_CACHE_SIZE) {
+		shortest = h->run_cache_size++;
+	} else if (h->run_cache[shortest].length >= n) {
+		return;
+	}
+	h->run_cache[shortest].start = start_unit;
+	h->run_cache[shortest].length = n;
+}
+
+/*
+	return value:
+	    first unit of shortest cached run of at least n units or -1
+*/
+int run_cache_best(struct bitmap_heap *h, int n) {
+	int best = -1;
+	for (int i = 0; i < h->run_cache_size; i++) {
+		if (h->run_cache[i].length >= n &&
+		    (best == -1 || h->run_cache[i].length < h->run_cache[best].length)) {
+			best = i;
+		}
+	}
+	return (best == -1) ? -1 : h->run_cache[best].start;
+}
+
+/*
+	Args:
+	    start_unit, n is free range
+	return value:
+	    whole free run containing the range, found with count leading
+	    and trailing zeros of used masks
+*/
+struct free_run free_run_around(struct bitmap_heap *h, int start_unit, int n) {
+	struct free_run run;
+	int unit_nr = start_unit - 1;
+	while (unit_nr >= 0) {
+		int pos = unit_nr % 32;
+		uint32_t used = leaf_used(h, unit_nr / 32) & (uint32_t)((2ULL << pos) - 1);
+		if (used != 0) {
+			unit_nr = unit_nr - pos + (31 - __builtin_clz(used));
+			break;
+		}
+		unit_nr -= pos + 1;
+	}
+	run.start = unit_nr + 1;
+	// Units past alloc_units are used, so the loop stops inside bitmap
+	unit_nr = start_unit + n;
+	while (1) {
+		int pos = unit_nr % 32;
+		uint32_t rest = leaf_used(h, unit_nr / 32) >> pos;
+		if (rest != 0) {
+			unit_nr += __builtin_ctz(rest);
+			break;
+		}
+		unit_nr += 32 - pos;
+	}
+	run.length = unit_nr - run.start;
+	return run;
+}
+
+/*
+	Args:
+	    h - heap to be initialized
+	    memPool, memSize - memory managed by heap, bitmap and summary
+	    are stored at its end
+	    strategy - placement strategy: FIRST_FIT, NEXT_FIT or BEST_FIT
+*/
+void heap_init(struct bitmap_heap *h, void * memPool, int memSize, int strategy)
 {	
-	mempool_p = memPool;
+	h->placement = strategy;
+	h->mempool_p = memPool;
 	
 	// Compute number of units in memPool
 	int n_units = memSize / UNITSIZE;
 	
 	// Compute size of bitmap in bytes, 2 bits address 1 alloc_unit
-	bitmap_size = (n_units + 7) / 4;
+	// Round it up to whole 64-bit words, bitmap is searched by words
+	h->bitmap_size = (n_units + 7) / 4;
+	h->bitmap_size = (h->bitmap_size + 7) / 8 * 8;
 	
-	// Compute how many units does bitmap take 
-	int bitmap_units = (bitmap_size + UNITSIZE - 1) / UNITSIZE;
+	// Summary tree has a leaf for each word addressing units of memPool
+	h->summary_leaves = 1;
+	h->summary_levels = 0;
+	while (h->summary_leaves * 32 < n_units) {
+		h->summary_leaves *= 2;
+		h->summary_levels++;
+	}
+	int summary_size = 2 * h->summary_leaves * sizeof(struct summary);
+	
+	// Compute how many units does bitmap and summary take, bitmap is aligned to its words
+	int bitmap_units = (h->bitmap_size + summary_size + sizeof(uint64_t) - 1 + UNITSIZE - 1) / UNITSIZE;
 	
 	// Compute how many units are available
-	alloc_units = n_units - bitmap_units;
+	h->alloc_units = n_units - bitmap_units;
 	
-	bitmap_p = (char *)memPool + alloc_units * UNITSIZE;
+	h->bitmap_p = (char *)(((uintptr_t)memPool + h->alloc_units * UNITSIZE + sizeof(uint64_t) - 1) & ~(uintptr_t)(sizeof(uint64_t) - 1));
+	h->summary_p = (struct summary *)(h->bitmap_p + h->bitmap_size);
 	
 	// Initilize bitmap with zeroes
-	for (int i = 0; i < bitmap_size; i++) {
-		bitmap_p[i] = 0;
+	for (int i = 0; i < h->bitmap_size; i++) {
+		h->bitmap_p[i] = 0;
 	}
 	
 	// Mark unused bits of bitmap with 1s
-	for (int i = alloc_units * 2; i < bitmap_size * 8; i++) {
+	for (int i = h->alloc_units * 2; i < h->bitmap_size * 8; i++) {
 		int bit_nr = i % 8;
-		bitmap_p[i / 8] |= (1 << bit_nr);
+		h->bitmap_p[i / 8] |= (1 << bit_nr);
 	}
 
-//	cout << "alloc_units: " << alloc_units << "\n";
+	summary_update(h, 0, h->summary_leaves - 1);
+
+	h->rover = 0;
+	h->run_cache_size = 0;
+	h->alloc_blocks = 0;
+	h->alloc_units_used = 0;
+
+//	cout << "alloc_units: " << h->alloc_units << "\n";
 }
 
 /*
 	Args:
-	    unit_nr is number of unit to be marked as used
-	    is_first this is 1 if unit_nr is first in allocated memory
-	if is_first is 1, its odd bit has to be set to 1 
+	    start_unit is first unit of allocated memory
+	    n is number of units
+	Mark units as used word by word. Odd bit of start_unit is set to 1,
+	odd bits of other units are set to 0
 */
-void mark_unit_used(int unit_nr, int is_first) {
-	unit_nr *= 2;
-	int n_byte = unit_nr / 8;
-	int n_bit = unit_nr % 8;
-	bitmap_p[n_byte] |= (1 << n_bit);
-	if (is_first != 0) {
-		// Mark odd bit of first alloc_unit of sequence as 1
-		bitmap_p[n_byte] |= (1 << (n_bit + 1)); 
-	} else {
-		// Mark odd bit of not first alloc_unit of sequence as 0
-		bitmap_p[n_byte] &= ~(1 << (n_bit + 1));
+void mark_units_used(struct bitmap_heap *h, int start_unit, int n) {
+	int end = start_unit + n;
+	int unit_nr = start_unit;
+	while (unit_nr < end) {
+		int word_nr = unit_nr / 32;
+		int lo = unit_nr % 32;
+		int hi = (end - word_nr * 32 < 32) ? end - word_nr * 32 : 32;
+		uint64_t mask = (hi - lo == 32) ? ~0ULL : ((1ULL << ((hi - lo) * 2)) - 1) << (lo * 2);
+		uint64_t word = load_word(h, word_nr);
+		word = (word | (mask & EVEN_BITS)) & ~(mask & ~EVEN_BITS);
+		if (unit_nr == start_unit) {
+			word |= 2ULL << (lo * 2);
+		}
+		store_word(h, word_nr, word);
+		unit_nr = word_nr * 32 + hi;
 	}
+	summary_update(h, start_unit / 32, (end - 1) / 32);
+	run_cache_trim(h, start_unit, n);
 }
 
 /*
 	Args:
-	    unit_nr is number of alloc_unit to be free
-	     is_first this is true if unit_nr is first in allocated memory
+	    start_unit is first unit of allocated memory
+	    n is number of units
+	Clear even bits of units word by word
+*/
+void mark_units_free(struct bitmap_heap *h, int start_unit, int n) {
+	int end = start_unit + n;
+	int unit_nr = start_unit;
+	while (unit_nr < end) {
+		int word_nr = unit_nr / 32;
+		int lo = unit_nr % 32;
+		int hi = (end - word_nr * 32 < 32) ? end - word_nr * 32 : 32;
+		uint64_t mask = (hi - lo == 32) ? ~0ULL : ((1ULL << ((hi - lo) * 2)) - 1) << (lo * 2);
+		store_word(h, word_nr, load_word(h, word_nr) & ~(mask & EVEN_BITS));
+		unit_nr = word_nr * 32 + hi;
+	}
+	summary_update(h, start_unit / 32, (end - 1) / 32);
+}
+
+/*
+	Args:
+	    start_unit is first unit of allocated memory
 	return value:
-	     true if unit_nr was free
-*/ 
-bool mark_unit_free(int unit_nr, int is_first) {
-	unit_nr *= 2;
-	int n_byte = unit_nr / 8;
-	int n_bit = unit_nr % 8;
-	if (is_first) {
-		if ((bitmap_p[n_byte] & (3 << n_bit)) == (3 << n_bit)) {
-			bitmap_p[n_byte] &= ~(1 << (n_bit));
-			return true;
+	    number of units of allocated memory: start_unit and following units
+	    which are used and not first
+*/
+int block_units(struct bitmap_heap *h, int start_unit) {
+	int unit_nr = start_unit + 1;
+	while (unit_nr < h->alloc_units) {
+		uint64_t word = load_word(h, unit_nr / 32);
+		int pos = unit_nr % 32;
+		uint32_t rest = (used_units(word) & ~first_units(word)) >> pos;
+		int len = (~rest == 0) ? 32 : __builtin_ctz(~rest);
+		unit_nr += len;
+		if (pos + len < 32) {
+			break;
 		}
-		return false;
 	}
-	
-	if ((bitmap_p[n_byte] & (3 << n_bit)) == (1 << n_bit)){
-		bitmap_p[n_byte] &= ~(1 << (n_bit));
-		return true;
-	}
-	return false;
+	return unit_nr - start_unit;
 }
 
-void * HeapAlloc   ( int    size )
+/*
+	Find run of free alloc_units long enough for size with help of summary tree.
+	FIRST_FIT takes first such run, NEXT_FIT first one after previous allocation,
+	BEST_FIT shortest cached run and falls back to first fit.
+*/
+void * heap_alloc(struct bitmap_heap *h, int size)
 {
-	int zeros_in_row = 0;
-	int start_unit;
-	
 	// Compute num of units required for this size
 	int n_units = (size + UNITSIZE -1) / UNITSIZE;
-	
-	// Find free fragment for desired size
-	for (int i = 0; i < bitmap_size; i++) {
-		if ((bitmap_p[i] & 0x55) == 0x55) {
-			// All alloc_units addressed by bitmap_p[i] are used
-			zeros_in_row = 0;
-			continue;
-		}
-#if 0
-		if ((bitmap_p[i] & 0x55) == 0) {
-			// All alloc_units addressed by bitmap_p[i] are free
-			if (zeros_in_row == 0) {
-				start_unit = (i * 8) / 2;
-			}
-			zeros_in_row++;
-			if ((n_units - zeros_in_row) > 3) {
-				zeros_in_row += 3;
-			} else {
-				zeros_in_row = n_units;
-				// We found sufficient number of free alloc_units
-				// Mark units as used
-				for (int k = 0; k < zeros_in_row; k++) {
-					mark_unit_used(start_unit + k, (k == 0) ? 1 : 0);
-				}
-				return (void*)((char *)mempool_p + start_unit * UNITSIZE);
-			}
-			continue;
-		}
-#endif
-		for (int j = 0; j < 8; j += 2) {
-			if (bitmap_p[i] & (1 << j)) {
-				zeros_in_row = 0;
-				continue;
-			}
-			if (zeros_in_row == 0) {
-				// Remember start of fragment
-				start_unit = (i * 8 + j) / 2;
-			}
-			zeros_in_row++;
-			
-			if (zeros_in_row == n_units) {
-				// We found sufficient number of free alloc_units
-				// Mark units as used
-				for (int k = 0; k < zeros_in_row; k++) {
-					mark_unit_used(start_unit + k, (k == 0) ? 1 : 0);
-				}
-				return (void*)((char *)mempool_p + start_unit * UNITSIZE);
-			}
-		}	
+	if (n_units <= 0) {
+		return nullptr;
 	}
 	
-	return nullptr; 
+	int start_unit = -1;
+	if (h->placement == NEXT_FIT) {
+		start_unit = summary_find_from(h, 1, n_units, h->rover);
+	} else if (h->placement == BEST_FIT) {
+		start_unit = run_cache_best(h, n_units);
+	}
+	if (start_unit == -1) {
+		start_unit = summary_find(h, n_units);
+	}
+	if (start_unit == -1) {
+		return nullptr; 
+	}
+	mark_units_used(h, start_unit, n_units);
+	h->alloc_blocks++;
+	h->alloc_units_used += n_units;
+	h->rover = (start_unit + n_units < h->alloc_units) ? start_unit + n_units : 0;
+	return (void*)((char *)h->mempool_p + start_unit * UNITSIZE);
 }
 
-bool is_valid_address(void* blk) {
+bool is_valid_address(struct bitmap_heap *h, void* blk) {
 	int start_unit;
 	
-	if ((blk < mempool_p) || (blk >= bitmap_p)) {
+	if ((blk < h->mempool_p) || (blk >= h->bitmap_p)) {
 		return false;
 	}
 	
-	if ((((char*)blk - (char*)mempool_p) % UNITSIZE) != 0) {
+	if ((((char*)blk - (char*)h->mempool_p) % UNITSIZE) != 0) {
 		return false;
 	}
 	
-	start_unit = ((char*)blk - (char*)mempool_p) / UNITSIZE;
-	start_unit *= 2;
-	int n_byte = start_unit / 8;
-	int n_bit = start_unit % 8;
+	start_unit = ((char*)blk - (char*)h->mempool_p) / UNITSIZE;
+	int n_bit = (start_unit % 32) * 2;
 	
-	if ((bitmap_p[n_byte] & (3 << n_bit)) != (3 << n_bit)) {
+	if (((load_word(h, start_unit / 32) >> n_bit) & 3) != 3) {
 		return false;
 	}
 	
 	return true;
 }
 
-bool   HeapFree    ( void * blk )
+bool heap_free(struct bitmap_heap *h, void * blk)
 {
-	if (!is_valid_address(blk)) {
+	if (!is_valid_address(h, blk)) {
 		return false;
 	}
 	
-	int start_unit = ((char*)blk - (char*)mempool_p) / UNITSIZE;
-	int is_first = 1;
-	
-	while (mark_unit_free(start_unit, is_first)) {
-		start_unit++;
-		if (start_unit == alloc_units)
-			break;
-		is_first = 0;
+	int start_unit = ((char*)blk - (char*)h->mempool_p) / UNITSIZE;
+	int n_units = block_units(h, start_unit);
+	mark_units_free(h, start_unit, n_units);
+	h->alloc_blocks--;
+	h->alloc_units_used -= n_units;
+	if (h->placement == BEST_FIT) {
+		struct free_run run = free_run_around(h, start_unit, n_units);
+		run_cache_insert(h, run.start, run.length);
 	}
 	
 	return true;
 }
 
+// Bytes granted to block blk, 0 if blk is not start of allocated block
+int heap_block_size(struct bitmap_heap *h, void * blk)
+{
+	if (!is_valid_address(h, blk)) {
+		return 0;
+	}
+	return block_units(h, ((char*)blk - (char*)h->mempool_p) / UNITSIZE) * UNITSIZE;
+}
+
+/*
+	Args:
+	    start_unit, n is range of units
+	return value:
+	    true if all units of range are free, checked word by word
+*/
+bool units_free(struct bitmap_heap *h, int start_unit, int n) {
+	if (start_unit + n > h->alloc_units) {
+		return false;
+	}
+	int end = start_unit + n;
+	int unit_nr = start_unit;
+	while (unit_nr < end) {
+		int word_nr = unit_nr / 32;
+		int lo = unit_nr % 32;
+		int hi = (end - word_nr * 32 < 32) ? end - word_nr * 32 : 32;
+		uint32_t mask = (hi - lo == 32) ? 0xffffffff : ((1U << (hi - lo)) - 1) << lo;
+		if (leaf_used(h, word_nr) & mask) {
+			return false;
+		}
+		unit_nr = word_nr * 32 + hi;
+	}
+	return true;
+}
+
+/*
+	Args:
+	    blk - block allocated by heap_alloc or nullptr
+	    size - new size of block
+	return value:
+	    address of resized block, nullptr if there is not enough memory
+	    (blk is kept then) or blk is invalid
+	Block grows in place when units following it are free and shrinks in
+	place by freeing its tail units. It is moved only when it can not grow.
+*/
+void * heap_realloc(struct bitmap_heap *h, void * blk, int size)
+{
+	if (blk == nullptr) {
+		return heap_alloc(h, size);
+	}
+	if (!is_valid_address(h, blk)) {
+		return nullptr;
+	}
+	if (size <= 0) {
+		heap_free(h, blk);
+		return nullptr;
+	}
+
+	int start_unit = ((char*)blk - (char*)h->mempool_p) / UNITSIZE;
+	int old_units = block_units(h, start_unit);
+	int n_units = (size + UNITSIZE -1) / UNITSIZE;
+
+	if (n_units < old_units) {
+		// Free tail units
+		mark_units_free(h, start_unit + n_units, old_units - n_units);
+		h->alloc_units_used -= old_units - n_units;
+		if (h->placement == BEST_FIT) {
+			struct free_run run = free_run_around(h, start_unit + n_units, old_units - n_units);
+			run_cache_insert(h, run.start, run.length);
+		}
+		return blk;
+	}
+	if (n_units == old_units) {
+		return blk;
+	}
+
+	int tail = start_unit + old_units;
+	if (units_free(h, tail, n_units - old_units)) {
+		// Append tail units to block, tail is not block start
+		mark_units_used(h, tail, n_units - old_units);
+		store_word(h, tail / 32, load_word(h, tail / 32) & ~(2ULL << (tail % 32 * 2)));
+		h->alloc_units_used += n_units - old_units;
+		return blk;
+	}
+
+	void *new_blk = heap_alloc(h, size);
+	if (new_blk == nullptr) {
+		return nullptr;
+	}
+	memcpy(new_blk, blk, old_units * UNITSIZE);
+	heap_free(h, blk);
+	return new_blk;
+}
+
+void heap_done(struct bitmap_heap *h, int * pendingBlk)
+{
+	pendingBlk[0] = h->alloc_blocks;
+}
+
+/*
+	Occupancy from live counters, cheap enough to be polled at high frequency.
+	Args:
+	    blocks - number of allocated blocks
+	    units - number of allocated alloc_units
+	    largest_free - longest run of free alloc_units, read from root of summary tree
+*/
+void heap_stats(struct bitmap_heap *h, int* blocks, int* units, int* largest_free) {
+	*blocks = h->alloc_blocks;
+	*units = h->alloc_units_used;
+	*largest_free = h->summary_p[1].longest;
+}
+
+/*
+	Recount allocated blocks and units from bitmap, one popcount per word:
+	block starts have both bits set, used units have even bit set.
+	Used to check live counters.
+*/
+void heap_audit(struct bitmap_heap *h, int* blocks, int* units) {
+	*blocks = 0;
+	*units = 0;
+	for (int w = 0; w * 32 < h->alloc_units; w++) {
+		uint64_t word = load_word(h, w);
+		if (h->alloc_units - w * 32 < 32) {
+			// Units past alloc_units are marked used
+			word &= (1ULL << ((h->alloc_units - w * 32) * 2)) - 1;
+		}
+		*blocks += __builtin_popcountll(word & (word >> 1) & EVEN_BITS);
+		*units += __builtin_popcountll(word & EVEN_BITS);
+	}
+}
+
+/*
+	Progtest interface works with single default heap
+*/
+struct bitmap_heap default_heap;
+int default_placement = FIRST_FIT;
+
+// Select placement strategy of default heap, it is kept by HeapInit
+void HeapPlacement(int strategy) {
+	default_placement = strategy;
+	default_heap.placement = strategy;
+}
+
+void   HeapInit    ( void * memPool, int memSize )
+{
+	heap_init(&default_heap, memPool, memSize, default_placement);
+}
+
+void * HeapAlloc   ( int    size )
+{
+	return heap_alloc(&default_heap, size);
+}
+
+bool   HeapFree    ( void * blk )
+{
+	return heap_free(&default_heap, blk);
+}
+
+void * HeapRealloc ( void * blk, int size )
+{
+	return heap_realloc(&default_heap, blk, size);
+}
+
 void   HeapDone    ( int  * pendingBlk )
 {
-	pendingBlk[0] = 0;
-	for (int i = 0; i < alloc_units; i++) {
-		int n_byte = (i * 2) / 8;
-		int n_bit = (i * 2) % 8;
-		if ((bitmap_p[n_byte] & (3 << n_bit)) == (3 << n_bit)) {
-			pendingBlk[0]++;
+	heap_done(&default_heap, pendingBlk);
+}
+
+void HeapStats(int* blocks, int* units, int* largest_free) {
+	heap_stats(&default_heap, blocks, units, largest_free);
+}
+
+void HeapAudit(int* blocks, int* units) {
+	heap_audit(&default_heap, blocks, units);
+}
+
+int HeapBlockSize(void * blk) {
+	return heap_block_size(&default_heap, blk);
+}
+
+// Bytes available for allocation in empty heap
+int HeapCapacity(void) {
+	return default_heap.alloc_units * UNITSIZE;
+}
+
+/*
+	Small objects of SLAB_MIN_SIZE .. SLAB_MAX_SIZE bytes are served from slabs.
+	Slab is block of SLAB_UNITS units allocated by heap_alloc, it starts with
+	struct slab and holds objects of one size class, class c has objects of
+	SLAB_MIN_SIZE << c bytes. Bit k of free_map is 1 if k-th object is free.
+	Slabs with free objects are linked in list of their class, so allocation
+	takes first free object of first slab of the list. Larger allocations go
+	directly to the bitmap heap.
+*/
+struct slab {
+	uint32_t magic;
+	int size_class;
+	int free_objects;
+	int n_objects;
+	// Offset of first object from start of slab
+	int first_object;
+	// Start of slab, used to check slab found by slab_of
+	struct slab *self;
+	struct slab *next;
+	struct slab *prev;
+	uint64_t free_map[SLAB_MAP_WORDS];
+};
+
+struct slab_heap {
+	struct bitmap_heap *heap;
+	struct slab *partial[SLAB_CLASSES];
+	// Number of slabs and of allocated small objects
+	int slabs;
+	int objects;
+};
+
+void slab_heap_init(struct slab_heap *sh, struct bitmap_heap *h) {
+	sh->heap = h;
+	for (int c = 0; c < SLAB_CLASSES; c++) {
+		sh->partial[c] = nullptr;
+	}
+	sh->slabs = 0;
+	sh->objects = 0;
+}
+
+// Size class for size, SLAB_CLASSES if size is too big for slab
+int size_class(int size) {
+	if (size <= SLAB_MIN_SIZE) {
+		return 0;
+	}
+	int c = 32 - __builtin_clz(size - 1) - __builtin_ctz(SLAB_MIN_SIZE);
+	return (c < SLAB_CLASSES) ? c : SLAB_CLASSES;
+}
+
+void slab_unlink(struct slab_heap *sh, struct slab *s) {
+	if (s->prev != nullptr) {
+		s->prev->next = s->next;
+	} else {
+		sh->partial[s->size_class] = s->next;
+	}
+	if (s->next != nullptr) {
+		s->next->prev = s->prev;
+	}
+}
+
+void slab_push(struct slab_heap *sh, struct slab *s) {
+	s->prev = nullptr;
+	s->next = sh->partial[s->size_class];
+	if (s->next != nullptr) {
+		s->next->prev = s;
+	}
+	sh->partial[s->size_class] = s;
+}
+
+// Allocate slab of size class c and link it to list of the class
+struct slab * slab_new(struct slab_heap *sh, int c) {
+	struct slab *s = (struct slab *)heap_alloc(sh->heap, SLAB_UNITS * UNITSIZE);
+	if (s == nullptr) {
+		return nullptr;
+	}
+	int obj_size = SLAB_MIN_SIZE << c;
+	s->magic = SLAB_MAGIC;
+	s->size_class = c;
+	s->self = s;
+	s->first_object = (sizeof(struct slab) + obj_size - 1) / obj_size * obj_size;
+	s->n_objects = (SLAB_UNITS * UNITSIZE - s->first_object) / obj_size;
+	s->free_objects = s->n_objects;
+	for (int w = 0; w < SLAB_MAP_WORDS; w++) {
+		int n = s->n_objects - w * 64;
+		s->free_map[w] = (n >= 64) ? ~0ULL : (n > 0) ? (1ULL << n) - 1 : 0;
+	}
+	slab_push(sh, s);
+	sh->slabs++;
+	return s;
+}
+
+void * slab_alloc(struct slab_heap *sh, int size) {
+	if (size <= 0) {
+		return nullptr;
+	}
+	int c = size_class(size);
+	if (c == SLAB_CLASSES) {
+		return heap_alloc(sh->heap, size);
+	}
+	struct slab *s = sh->partial[c];
+	if (s == nullptr) {
+		s = slab_new(sh, c);
+		if (s == nullptr) {
+			return nullptr;
+		}
+	}
+	int w = 0;
+	while (s->free_map[w] == 0) {
+		w++;
+	}
+	int obj_nr = w * 64 + __builtin_ctzll(s->free_map[w]);
+	s->free_map[w] &= s->free_map[w] - 1;
+	if (--s->free_objects == 0) {
+		slab_unlink(sh, s);
+	}
+	sh->objects++;
+	return (char *)s + s->first_object + obj_nr * (SLAB_MIN_SIZE << c);
+}
+
+// Block starting at unit_nr is slab: it has slab header and slab size
+bool is_slab(struct bitmap_heap *h, int unit_nr) {
+	struct slab *s = (struct slab *)((char *)h->mempool_p + unit_nr * UNITSIZE);
+	return s->magic == SLAB_MAGIC && s->self == s && block_units(h, unit_nr) == SLAB_UNITS;
+}
+
+/*
+	Args:
+	    blk - address inside of slab
+	return value:
+	    slab holding blk: start of block found within SLAB_UNITS units
+	    before blk with help of first bits of bitmap, or nullptr
+*/
+struct slab * slab_of(struct slab_heap *sh, void * blk) {
+	struct bitmap_heap *h = sh->heap;
+	if ((blk < h->mempool_p) || (blk >= h->bitmap_p)) {
+		return nullptr;
+	}
+	int unit_nr = ((char*)blk - (char*)h->mempool_p) / UNITSIZE;
+	int low = (unit_nr >= SLAB_UNITS) ? unit_nr - SLAB_UNITS + 1 : 0;
+	while (unit_nr >= low) {
+		int pos = unit_nr % 32;
+		uint64_t word = load_word(h, unit_nr / 32);
+		uint32_t starts = used_units(word) & first_units(word) & (uint32_t)((2ULL << pos) - 1);
+		if (starts != 0) {
+			unit_nr = unit_nr - pos + (31 - __builtin_clz(starts));
+			break;
 		}
+		unit_nr -= pos + 1;
+	}
+	if (unit_nr < low) {
+		return nullptr;
+	}
+	if (!is_slab(h, unit_nr)) {
+		return nullptr;
+	}
+	return (struct slab *)((char *)h->mempool_p + unit_nr * UNITSIZE);
+}
+
+bool slab_free(struct slab_heap *sh, void * blk) {
+	if (is_valid_address(sh->heap, blk)) {
+		// Start of block is never object of slab, slab starts with its header
+		if (is_slab(sh->heap, ((char *)blk - (char *)sh->heap->mempool_p) / UNITSIZE)) {
+			// Slab is freed only with its last object
+			return false;
+		}
+		return heap_free(sh->heap, blk);
+	}
+	struct slab *s = slab_of(sh, blk);
+	if (s == nullptr) {
+		return false;
+	}
+	int obj_size = SLAB_MIN_SIZE << s->size_class;
+	int offset = (char *)blk - (char *)s - s->first_object;
+	if (offset < 0 || offset % obj_size != 0 || offset / obj_size >= s->n_objects) {
+		return false;
+	}
+	int obj_nr = offset / obj_size;
+	uint64_t bit = 1ULL << (obj_nr % 64);
+	if (s->free_map[obj_nr / 64] & bit) {
+		return false;
+	}
+	s->free_map[obj_nr / 64] |= bit;
+	sh->objects--;
+	if (++s->free_objects == 1) {
+		slab_push(sh, s);
+	}
+	if (s->free_objects == s->n_objects) {
+		// Return empty slab to heap
+		slab_unlink(sh, s);
+		s->magic = 0;
+		heap_free(sh->heap, s);
+		sh->slabs--;
+	}
+	return true;
+}
+
+/*
+	Args:
+	    pendingBlk - number of allocated small objects and large blocks
+*/
+void slab_done(struct slab_heap *sh, int * pendingBlk) {
+	pendingBlk[0] = sh->objects + sh->heap->alloc_blocks - sh->slabs;
+}
+
+/*
+	Pool is split into n_arenas arenas of equal size, each with its own heap and lock.
+	Thread allocates from its arena, so threads do not contend for one lock.
+	Block freed by thread of other arena is pushed to lock-free stack of owning
+	arena and freed by the arena on its next allocation.
+*/
+struct arena {
+	struct bitmap_heap heap;
+	pthread_mutex_t mtx;
+	// Blocks freed by other threads, linked through their first bytes
+	std::atomic<void*> remote_free;
+	/*
+		Bit per alloc_unit of heap, set while block starting at the unit is
+		being freed, so that block is pushed to remote_free only once.
+		Kept at the end of arena, after memory of heap
+	*/
+	uint64_t *claimed;
+};
+
+struct arena_heap {
+	char *pool;
+	int arena_size;
+	int n_arenas;
+	struct arena arenas[ARENA_MAX];
+};
+
+// Arena of thread is assigned round robin when thread uses arena heap first time
+thread_local int thread_arena = -1;
+std::atomic<int> next_thread_arena(0);
+
+int my_arena(struct arena_heap *ah) {
+	if (thread_arena == -1) {
+		thread_arena = next_thread_arena++;
+	}
+	return thread_arena % ah->n_arenas;
+}
+
+void arena_heap_init(struct arena_heap *ah, void * memPool, int memSize, int n_arenas, int strategy) {
+	assert(n_arenas > 0 && n_arenas <= ARENA_MAX);
+	ah->pool = (char *)memPool;
+	ah->n_arenas = n_arenas;
+	ah->arena_size = memSize / n_arenas / UNITSIZE * UNITSIZE;
+	int claimed_size = (ah->arena_size / UNITSIZE + 63) / 64 * sizeof(uint64_t);
+	for (int i = 0; i < n_arenas; i++) {
+		char *arena_start = ah->pool + i * ah->arena_size;
+		char *arena_end = arena_start + ah->arena_size;
+		// Bitmap is updated by 64 bit atomics, memPool need not be aligned
+		ah->arenas[i].claimed = (uint64_t *)((uintptr_t)(arena_end - claimed_size) & ~(uintptr_t)(sizeof(uint64_t) - 1));
+		memset(ah->arenas[i].claimed, 0, claimed_size);
+		heap_init(&ah->arenas[i].heap, arena_start, (char *)ah->arenas[i].claimed - arena_start, strategy);
+		pthread_mutex_init(&ah->arenas[i].mtx, nullptr);
+		ah->arenas[i].remote_free.store(nullptr);
+	}
+}
+
+/*
+	Args:
+	    blk is start of allocated block of arena
+	return value:
+	    true if caller is the only one freeing blk, false if it is being freed
+	    by someone else already
+*/
+bool arena_claim(struct arena *a, void * blk) {
+	int unit = ((char *)blk - (char *)a->heap.mempool_p) / UNITSIZE;
+	uint64_t bit = 1ULL << (unit % 64);
+	return (__atomic_fetch_or(&a->claimed[unit / 64], bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
+
+void arena_unclaim(struct arena *a, void * blk) {
+	int unit = ((char *)blk - (char *)a->heap.mempool_p) / UNITSIZE;
+	__atomic_fetch_and(&a->claimed[unit / 64], ~(1ULL << (unit % 64)), __ATOMIC_RELEASE);
+}
+
+// Free blocks pushed by other threads. Called with arena locked
+void arena_drain(struct arena *a) {
+	void *blk = a->remote_free.exchange(nullptr, memory_order_acquire);
+	while (blk != nullptr) {
+		void *next = *(void **)blk;
+		heap_free(&a->heap, blk);
+		arena_unclaim(a, blk);
+		blk = next;
+	}
+}
+
+/*
+	Allocate from arena of calling thread, other arenas are tried
+	only if it is full
+*/
+void * arena_alloc(struct arena_heap *ah, int size) {
+	int first = my_arena(ah);
+	for (int k = 0; k < ah->n_arenas; k++) {
+		struct arena *a = &ah->arenas[(first + k) % ah->n_arenas];
+		pthread_mutex_lock(&a->mtx);
+		if (a->remote_free.load(memory_order_relaxed) != nullptr) {
+			arena_drain(a);
+		}
+		void *blk = heap_alloc(&a->heap, size);
+		pthread_mutex_unlock(&a->mtx);
+		if (blk != nullptr) {
+			return blk;
+		}
+	}
+	return nullptr;
+}
+
+/*
+	Block of own arena is freed directly. Block of other arena is checked
+	without lock, bitmap words are read atomically and start of allocated
+	block does not change until it is freed, then it is pushed to arena stack.
+	Either way block is claimed first, so that double free returns false
+	instead of pushing block twice or freeing block which is on the stack.
+*/
+bool arena_free(struct arena_heap *ah, void * blk) {
+	if ((char *)blk < ah->pool || (char *)blk >= ah->pool + ah->n_arenas * ah->arena_size) {
+		return false;
+	}
+	int i = ((char *)blk - ah->pool) / ah->arena_size;
+	struct arena *a = &ah->arenas[i];
+	if (!is_valid_address(&a->heap, blk) || !arena_claim(a, blk)) {
+		return false;
+	}
+	if (i == my_arena(ah)) {
+		pthread_mutex_lock(&a->mtx);
+		bool res = heap_free(&a->heap, blk);
+		arena_unclaim(a, blk);
+		pthread_mutex_unlock(&a->mtx);
+		return res;
+	}
+	if (!is_valid_address(&a->heap, blk)) {
+		// Freed by owner before it was claimed
+		arena_unclaim(a, blk);
+		return false;
+	}
+	void *head = a->remote_free.load(memory_order_relaxed);
+	do {
+		*(void **)blk = head;
+	} while (!a->remote_free.compare_exchange_weak(head, blk, memory_order_release, memory_order_relaxed));
+	return true;
+}
+
+// Number of allocated blocks in all arenas, remote frees are applied first
+void arena_done(struct arena_heap *ah, int * pendingBlk) {
+	pendingBlk[0] = 0;
+	for (int i = 0; i < ah->n_arenas; i++) {
+		int pending;
+		pthread_mutex_lock(&ah->arenas[i].mtx);
+		arena_drain(&ah->arenas[i]);
+		heap_done(&ah->arenas[i].heap, &pending);
+		pthread_mutex_unlock(&ah->arenas[i].mtx);
+		pendingBlk[0] += pending;
 	}
 }
 
 #ifndef __PROGTEST__
+#define ARENA_THREADS 4
+#define ARENA_BLOCKS 200
+
+struct arena_heap arenaHeap;
+void          * arenaBlocks[ARENA_THREADS][ARENA_BLOCKS];
+pthread_barrier_t arenaBarrier;
+
+// each thread allocates blocks, then frees blocks allocated by its neighbour
+void          * arenaTest ( void * arg )
+{
+  int id = (int)(intptr_t) arg;
+  for ( int i = 0; i < ARENA_BLOCKS; i ++ )
+  {
+    int size = 100 + ( id * 7919 + i * 104729 ) % 5000;
+    assert ( ( arenaBlocks[id][i] = arena_alloc ( &arenaHeap, size ) ) != NULL );
+    memset ( arenaBlocks[id][i], id, size );
+  }
+  pthread_barrier_wait ( &arenaBarrier );
+  int other = ( id + 1 ) % ARENA_THREADS;
+  for ( int i = 0; i < ARENA_BLOCKS; i ++ )
+  {
+    assert ( *(uint8_t *) arenaBlocks[other][i] == other );
+    assert ( arena_free ( &arenaHeap, arenaBlocks[other][i] ) );
+  }
+  return NULL;
+}
+
+// block of arena 0 freed twice by thread of other arena, stack must hold it once
+void          * arenaDoubleFree ( void * arg )
+{
+  void * blk;
+  my_arena ( &arenaHeap );
+  assert ( thread_arena % ARENA_THREADS != 0 );
+  blk = arenaHeap.arenas[0].heap.mempool_p;
+  pthread_mutex_lock ( &arenaHeap.arenas[0].mtx );
+  assert ( heap_alloc ( &arenaHeap.arenas[0].heap, 1000 ) == blk );
+  pthread_mutex_unlock ( &arenaHeap.arenas[0].mtx );
+  assert ( arena_free ( &arenaHeap, blk ) );
+  assert ( ! arena_free ( &arenaHeap, blk ) );
+  assert ( arenaHeap.arenas[0].remote_free.load () == blk && *(void **) blk == NULL );
+  return NULL;
+}
+
 int main ( void )
 {
   uint8_t       * p0, *p1, *p2, *p3, *p4;
-  int             pendingBlk;
+  int             pendingBlk, auditBlk, auditUnits;
+  int             statBlk, statUnits, largestFree;
   static uint8_t  memPool[3 * 1048576];
 
   HeapInit ( memPool, 2097152 );
@@ -227,7 +1204,12 @@ int main ( void )
   assert ( ( p2 = (uint8_t*) HeapAlloc ( 26000 ) ) != NULL );
   memset ( p2, 0, 26000 );
   HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
   assert ( pendingBlk == 3 );
+  HeapStats ( &statBlk, &statUnits, &largestFree );
+  assert ( statBlk == 3 && statUnits == auditUnits );
+  assert ( largestFree > 0 );
 
 
   HeapInit ( memPool, 2097152 );
@@ -253,6 +1235,8 @@ int main ( void )
   assert ( HeapFree ( p0 ) );
   assert ( HeapFree ( p1 ) );
   HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
   assert ( pendingBlk == 0 );
 
 
@@ -270,6 +1254,8 @@ int main ( void )
   assert ( HeapFree ( p0 ) );
   assert ( HeapFree ( p1 ) );
   HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
   assert ( pendingBlk == 1 );
 
 
@@ -278,9 +1264,138 @@ int main ( void )
   memset ( p0, 0, 1000000 );
   assert ( ! HeapFree ( p0 + 1000 ) );
   HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
   assert ( pendingBlk == 1 );
 
 
+  HeapPlacement ( NEXT_FIT );
+  HeapInit ( memPool, 2097152 );
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 100000 ) ) != NULL );
+  assert ( ( p1 = (uint8_t*) HeapAlloc ( 100000 ) ) != NULL );
+  assert ( HeapFree ( p0 ) );
+  // next fit continues after p1 instead of reusing hole of p0
+  assert ( ( p2 = (uint8_t*) HeapAlloc ( 1000 ) ) != NULL );
+  assert ( p2 > p1 );
+  assert ( HeapFree ( p1 ) );
+  assert ( HeapFree ( p2 ) );
+  HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
+  assert ( pendingBlk == 0 );
+
+
+  HeapPlacement ( BEST_FIT );
+  HeapInit ( memPool, 2097152 );
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 100000 ) ) != NULL );
+  assert ( ( p1 = (uint8_t*) HeapAlloc ( 1000 ) ) != NULL );
+  assert ( ( p2 = (uint8_t*) HeapAlloc ( 3000 ) ) != NULL );
+  assert ( ( p3 = (uint8_t*) HeapAlloc ( 1000 ) ) != NULL );
+  assert ( HeapFree ( p0 ) );
+  assert ( HeapFree ( p2 ) );
+  // best fit takes the small hole of p2
+  assert ( ( p4 = (uint8_t*) HeapAlloc ( 2000 ) ) == p2 );
+  assert ( HeapFree ( p1 ) );
+  assert ( HeapFree ( p3 ) );
+  assert ( HeapFree ( p4 ) );
+  HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
+  assert ( pendingBlk == 0 );
+  HeapPlacement ( FIRST_FIT );
+
+
+  HeapInit ( memPool, 2097152 );
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 1000 ) ) != NULL );
+  memset ( p0, 0x55, 1000 );
+  // grows in place into free units after p0
+  assert ( HeapRealloc ( p0, 5000 ) == p0 );
+  assert ( ( p1 = (uint8_t*) HeapAlloc ( 1000 ) ) != NULL );
+  assert ( p1 == p0 + 5120 );
+  // shrinks in place, freed tail is reused
+  assert ( HeapRealloc ( p0, 2000 ) == p0 );
+  assert ( ( p2 = (uint8_t*) HeapAlloc ( 3000 ) ) == p0 + 2048 );
+  // p0 is followed by p2, so it is moved
+  assert ( ( p3 = (uint8_t*) HeapRealloc ( p0, 4000 ) ) != NULL );
+  assert ( p3 != p0 );
+  for ( int i = 0; i < 1000; i ++ )
+    assert ( p3[i] == 0x55 );
+  assert ( ! HeapFree ( p0 ) );
+  assert ( HeapRealloc ( p3 + 128, 8000 ) == NULL );
+  assert ( HeapRealloc ( p3, 2100000 ) == NULL );
+  assert ( HeapFree ( p1 ) );
+  assert ( HeapFree ( p2 ) );
+  assert ( HeapFree ( p3 ) );
+  HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
+  assert ( pendingBlk == 0 );
+
+
+  struct slab_heap slabHeap;
+  uint8_t       * small[1000];
+  HeapInit ( memPool, 2097152 );
+  slab_heap_init ( &slabHeap, &default_heap );
+  for ( int i = 0; i < 1000; i ++ )
+  {
+    assert ( ( small[i] = (uint8_t*) slab_alloc ( &slabHeap, 16 ) ) != NULL );
+    memset ( small[i], i, 16 );
+  }
+  // 1000 objects of 16 bytes fit into two slabs
+  HeapStats ( &statBlk, &statUnits, &largestFree );
+  assert ( statBlk == 2 && statUnits == 2 * SLAB_UNITS );
+  assert ( ( p0 = (uint8_t*) slab_alloc ( &slabHeap, 1000 ) ) != NULL );
+  assert ( ( p1 = (uint8_t*) slab_alloc ( &slabHeap, 5000 ) ) != NULL );
+  for ( int i = 0; i < 1000; i ++ )
+    assert ( small[i][15] == (uint8_t) i );
+  assert ( ! slab_free ( &slabHeap, small[0] + 1 ) );
+  assert ( ! slab_free ( &slabHeap, p1 + 128 ) );
+  // slab header is neither large block nor object
+  p2 = (uint8_t*) slab_of ( &slabHeap, small[1] );
+  assert ( p2 != NULL && p2 < small[0] );
+  assert ( ! slab_free ( &slabHeap, p2 ) );
+  assert ( ! slab_free ( &slabHeap, p2 + 16 ) );
+  assert ( ! slab_free ( &slabHeap, small[0] - 16 ) );
+  for ( int i = 0; i < 1000; i += 2 )
+    assert ( slab_free ( &slabHeap, small[i] ) );
+  assert ( ! slab_free ( &slabHeap, small[0] ) );
+  // freed object is reused
+  assert ( ( p2 = (uint8_t*) slab_alloc ( &slabHeap, 10 ) ) != NULL );
+  assert ( p2 == small[0] || p2 == small[998] );
+  assert ( slab_free ( &slabHeap, p2 ) );
+  slab_done ( &slabHeap, &pendingBlk );
+  assert ( pendingBlk == 500 + 2 );
+  for ( int i = 1; i < 1000; i += 2 )
+    assert ( slab_free ( &slabHeap, small[i] ) );
+  assert ( slab_free ( &slabHeap, p0 ) );
+  assert ( slab_free ( &slabHeap, p1 ) );
+  slab_done ( &slabHeap, &pendingBlk );
+  assert ( pendingBlk == 0 );
+  HeapDone ( &pendingBlk );
+  HeapAudit ( &auditBlk, &auditUnits );
+  assert ( auditBlk == pendingBlk );
+  assert ( pendingBlk == 0 );
+
+
+  pthread_t       threads[ARENA_THREADS];
+  arena_heap_init ( &arenaHeap, memPool, 3 * 1048576, ARENA_THREADS, FIRST_FIT );
+  pthread_barrier_init ( &arenaBarrier, NULL, ARENA_THREADS );
+  for ( int i = 0; i < ARENA_THREADS; i ++ )
+    pthread_create ( &threads[i], NULL, arenaTest, (void *)(intptr_t) i );
+  for ( int i = 0; i < ARENA_THREADS; i ++ )
+    pthread_join ( threads[i], NULL );
+  pthread_barrier_destroy ( &arenaBarrier );
+  assert ( ( p0 = (uint8_t*) arena_alloc ( &arenaHeap, 1000 ) ) != NULL );
+  assert ( ! arena_free ( &arenaHeap, p0 + 128 ) );
+  assert ( arena_free ( &arenaHeap, p0 ) );
+  assert ( ! arena_free ( &arenaHeap, p0 ) );
+  // double free by thread of other arena while block waits on the stack
+  pthread_create ( &threads[0], NULL, arenaDoubleFree, NULL );
+  pthread_join ( threads[0], NULL );
+  arena_done ( &arenaHeap, &pendingBlk );
+  assert ( pendingBlk == 0 );
+
+
   return 0;
 }
 #endif /* __PROGTEST__ */
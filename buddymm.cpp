@@ -8,202 +8,877 @@
 #include <iostream>
 using namespace std;
 #endif /* __PROGTEST__ */
+#include <pthread.h>
 
+#define MINBUDDYSIZE 32
+// log2 of MINBUDDYSIZE, order of block is log2 of its size
+#define MINBUDDYORDER 5
+#define MAXORDER 32
+// Blocks of higher order give back their unused tail
+#define TRIMORDER 12
+// Freed blocks up to this order are cached by thread, first blocks of trimmed
+// allocations have order TRIMORDER or higher, so they are never cached
+#define CACHEORDER (TRIMORDER - 1)
+// Max number of cached blocks per order, half of them is merged when exceeded
+#define CACHE_BLOCKS 16
+// Slabs of slab caches are buddy blocks of SLAB_ORDER
+#define SLAB_ORDER 12
+#define SLAB_SIZE (1 << SLAB_ORDER)
+#define SLAB_MAX_SIZE (SLAB_SIZE / 8)
+#define SLAB_MAP_WORDS (SLAB_SIZE / 8 / 64)
+// Colours of slabs differ by cache line
+#define SLAB_COLOUR 64
+// Empty slabs kept by cache, more of them are returned to buddy heap
+#define SLAB_EMPTY_MAX 1
+#define SLAB_MAGIC 0x5AB5AB5Au
+// End of buddy free list
+#define BFL_NIL 0xffffffff
+
+/*
+	Element of buddy free list, it is stored in first bytes of free block.
+	Lists are linked by indexes of first minimal blocks of blocks
+*/
 struct BFLElement {
-	// Pointer to next element
+	// Index of next element
 	uint32_t next;
-	// Address
-	uint32_t address;
+	// Index of previous element
+	uint32_t prev;
 };
 
-struct BFLElement* usedBuddyList[32];
-struct BFLElement* freeBuddyList[32];
-
-struct BFLElement allMem;
+// Heads of free lists of blocks of order 0 .. MAXORDER - 1
+uint32_t freeBuddyList[MAXORDER];
+// Bit i is set if free list of order i is not empty
+uint32_t nonEmptyOrders;
 
 int maxOrder;
 
-#define MINBUDDYSIZE 32
+void* memory;
+
+// Start of memory managed by buddy system
+char* arena;
+// Number of minimal blocks of arena, arena need not be power of two
+uint32_t arenaUnits;
+
+/*
+	Per-order bitmaps, bit i of order k describes i-th block of size 1 << k:
+	freeMap - block is head of free list of order k
+	allocMap - block is allocated as block of order k
+	tailMap - allocated block continues previous block of the same allocation,
+	          trimmed allocation is made of blocks of decreasing orders
+*/
+uint64_t* freeMap[MAXORDER];
+uint64_t* allocMap[MAXORDER];
+uint64_t* tailMap[MAXORDER];
+
+int allocatedBlocks;
+
+// Protects free lists and nonEmptyOrders
+pthread_mutex_t buddyMtx = PTHREAD_MUTEX_INITIALIZER;
+// Incremented by HeapInit, caches of older heap are dropped
+int heapGeneration;
+
+/*
+	Blocks freed by thread and not merged yet, linked through next of their
+	BFLElement. Cached block is neither free nor allocated in bitmaps, so its
+	buddy does not merge with it and HeapFree of it fails.
+*/
+struct BuddyCache {
+	uint32_t head[CACHEORDER + 1];
+	int count[CACHEORDER + 1];
+	int generation;
+	~BuddyCache();
+};
 
-#if 0
-void BuddyUsedListInsert(union Block* blk, int order)
+thread_local struct BuddyCache buddyCache;
+
+// All slab caches, see SlabCacheCreate
+struct SlabCache* slabCaches;
+int SlabReclaim(void);
+
+// Number of 64-bit words of bitmap of order in arena of units minimal blocks
+int BitmapWords(uint32_t units, int order)
 {
-	union Block* head = usedBuddyList[order];
-	if (head == NULL) {
-		usedBuddyList[order] = blk;
-		return;
+	return ((units >> (order - MINBUDDYORDER)) + 63) / 64;
+}
+
+/*
+	Args:
+	    units - number of minimal blocks of arena
+	return value:
+	    bytes of metadata of arena: bitmaps of all orders
+*/
+long MetadataSize(uint32_t units)
+{
+	long words = 0;
+	for (int k = MINBUDDYORDER; k < MAXORDER - 1 && (units >> (k - MINBUDDYORDER)) > 0; k++) {
+		words += 3 * BitmapWords(units, k);
 	}
+	return words * sizeof(uint64_t);
+}
 
-	while (1) {
-		union Block* next = head->buddyFreeListBlock.next;
-		assert(head->buddyFreeListBlock.address < blk->buddyFreeListBlock.address);
+/*
+	Place bitmaps at start of memory, arena follows them
+*/
+void ReserveMemInit(void)
+{
+	uint64_t* map = (uint64_t*)memory;
+	for (int k = MINBUDDYORDER; k <= maxOrder; k++) {
+		int words = BitmapWords(arenaUnits, k);
+		freeMap[k] = map;
+		allocMap[k] = map + words;
+		tailMap[k] = map + 2 * words;
+		memset(map, 0, 3 * words * sizeof(uint64_t));
+		map += 3 * words;
+	}
+	arena = (char*)map;
+}
 
-		if ((next == NULL) || (next->buddyFreeListBlock.address > blk->buddyFreeListBlock.address)) {
-			// Insert blk after head before next
-			head->buddyFreeListBlock.next = blk;
-			blk->buddyFreeListBlock.next = head;
-			break;
+// Free list element of free block starting at minimal block idx
+struct BFLElement* BFLE(uint32_t idx)
+{
+	return (struct BFLElement*)(arena + idx * MINBUDDYSIZE);
+}
+
+/*
+	Bitmaps are accessed atomically, HeapFree of cached orders
+	checks and clears allocMap without buddyMtx
+*/
+bool TestBit(uint64_t* map, uint32_t bit)
+{
+	return (__atomic_load_n(&map[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
+
+void SetBit(uint64_t* map, uint32_t bit)
+{
+	__atomic_fetch_or(&map[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+}
+
+// return value: previous value of bit
+bool ClearBit(uint64_t* map, uint32_t bit)
+{
+	uint64_t mask = 1ULL << (bit % 64);
+	return __atomic_fetch_and(&map[bit / 64], ~mask, __ATOMIC_RELAXED) & mask;
+}
+
+/*
+	Args:
+	    idx - index of first minimal block of block
+	    order - order of block
+	Put block to head of free list of order
+*/
+void BuddyPush(uint32_t idx, int order)
+{
+	BFLE(idx)->prev = BFL_NIL;
+	BFLE(idx)->next = freeBuddyList[order];
+	if (freeBuddyList[order] != BFL_NIL) {
+		BFLE(freeBuddyList[order])->prev = idx;
+	}
+	freeBuddyList[order] = idx;
+	nonEmptyOrders |= 1U << order;
+	SetBit(freeMap[order], idx >> (order - MINBUDDYORDER));
+}
+
+// Unlink block from free list of order
+void BuddyRemove(uint32_t idx, int order)
+{
+	struct BFLElement* el = BFLE(idx);
+	if (el->prev != BFL_NIL) {
+		BFLE(el->prev)->next = el->next;
+	} else {
+		freeBuddyList[order] = el->next;
+		if (el->next == BFL_NIL) {
+			nonEmptyOrders &= ~(1U << order);
 		}
-		head = next;
 	}
+	if (el->next != BFL_NIL) {
+		BFLE(el->next)->prev = el->prev;
+	}
+	ClearBit(freeMap[order], idx >> (order - MINBUDDYORDER));
 }
-#endif
 
-void PrintBuddyList(struct BFLElement** buddyList, const char* msg)
+void PrintBuddyList(const char* msg)
 {
 	cout << msg << "\n"; 
-	for (int i = 0; i < 32; i++) {
-		if (buddyList[i] == NULL) {
+	for (int i = MINBUDDYORDER; i <= maxOrder; i++) {
+		if (freeBuddyList[i] == BFL_NIL) {
 			continue;
 		}
-		struct BFLElement* head = buddyList[i];
 		cout << "buddy size = " << (1 << i) << ", addresses: ";
-		while (head != NULL) {
-			cout << " " << head->address;
-			head = head->next;  
+		for (uint32_t idx = freeBuddyList[i]; idx != BFL_NIL; idx = BFLE(idx)->next) {
+			cout << " " << idx * MINBUDDYSIZE;
 		}
 		cout << "\n";
 	}
 }
 
-#if 0
-void BuddyFreeListInsert(union Block* blk, int order)
+/*
+	Arena takes rest of memPool after metadata. It is covered by the largest
+	blocks aligned to their size, e.g. 1.5 MiB arena by 1 MiB and 512 KiB blocks
+*/
+void   HeapInit    ( void * memPool, int memSize )
 {
-	union Block* head = freeBuddyList[order];
-	if (head == NULL) {
-		freeBuddyList[order] = blk;
+	memory = memPool;
+	// Bitmaps take less than a byte per minimal block
+	arenaUnits = memSize / (MINBUDDYSIZE + 1);
+	while (arenaUnits > 0 && (long)arenaUnits * MINBUDDYSIZE + MetadataSize(arenaUnits) > memSize) {
+		arenaUnits--;
+	}
+	for (int i = 0; i < MAXORDER; i++) {
+		freeBuddyList[i] = BFL_NIL;
+	}
+	nonEmptyOrders = 0;
+	allocatedBlocks = 0;
+	heapGeneration++;
+	slabCaches = NULL;
+	if (arenaUnits == 0) {
+		maxOrder = MINBUDDYORDER - 1;
 		return;
 	}
+	maxOrder = MINBUDDYORDER + 31 - __builtin_clz(arenaUnits);
+	ReserveMemInit();
+	uint32_t idx = 0;
+	while (idx < arenaUnits) {
+		// Largest block aligned at idx and fitting into rest of arena
+		int order = MINBUDDYORDER + 31 - __builtin_clz(arenaUnits - idx);
+		if (idx != 0 && MINBUDDYORDER + __builtin_ctz(idx) < order) {
+			order = MINBUDDYORDER + __builtin_ctz(idx);
+		}
+		BuddyPush(idx, order);
+		idx += 1 << (order - MINBUDDYORDER);
+	}
+}
 
-	while (1) {
-		union Block* next = head->buddyFreeListBlock.next;
-		assert(head->buddyFreeListBlock.address < blk->buddyFreeListBlock.address);
+/*
+	Args:
+	    order - order of requested block
+	return value:
+	    block taken from the smallest non-empty free list of order or higher,
+	    found by count trailing zeros of nonEmptyOrders, split down to order, or NULL
+*/
+void* BuddyAlloc(int order) {
+	uint32_t orders = nonEmptyOrders & (~0U << order);
+	if (orders == 0) {
+		return NULL;
+	}
+	int i = __builtin_ctz(orders);
+	uint32_t idx = freeBuddyList[i];
+	BuddyRemove(idx, i);
+	// Split block, upper halves go to free lists
+	while (i > order) {
+		i--;
+		BuddyPush(idx + (1 << (i - MINBUDDYORDER)), i);
+	}
+	SetBit(allocMap[order], idx >> (order - MINBUDDYORDER));
+	__atomic_fetch_add(&allocatedBlocks, 1, __ATOMIC_RELAXED);
+	return arena + idx * MINBUDDYSIZE;
+}
 
-		if ((next == NULL) || (next->buddyFreeListBlock.address > blk->buddyFreeListBlock.address)) {
-			// Insert blk after head before next
-			head->buddyFreeListBlock.next = blk;
-			blk->buddyFreeListBlock.next = head;
+/*
+	Args:
+	    idx - index of first minimal block of allocated block
+	    order - order of block
+	Merge block with its buddy while the buddy is free
+*/
+void BuddyFree(uint32_t idx, int order)
+{
+	ClearBit(allocMap[order], idx >> (order - MINBUDDYORDER));
+	while (order < maxOrder) {
+		uint32_t buddy = idx ^ (1 << (order - MINBUDDYORDER));
+		if (buddy + (1 << (order - MINBUDDYORDER)) > arenaUnits ||
+		    !TestBit(freeMap[order], buddy >> (order - MINBUDDYORDER))) {
 			break;
 		}
-		head = next;
+		BuddyRemove(buddy, order);
+		idx &= ~(1 << (order - MINBUDDYORDER));
+		order++;
 	}
+	BuddyPush(idx, order);
 }
-#endif
-
-void* memory;
 
-struct BFLElement* reservedMemory;
+/*
+	Args:
+	    idx - index of first minimal block of allocated block
+	    order - order of block
+	    units - number of minimal blocks really needed
+	Keep first units of block as blocks of decreasing orders (binary digits
+	of units) and return the tail to free lists. Tail blocks are upper halves
+	of their buddies, which are kept, so they do not merge.
+*/
+void BuddyTrim(uint32_t idx, int order, uint32_t units)
+{
+	ClearBit(allocMap[order], idx >> (order - MINBUDDYORDER));
+	uint32_t off = 0;
+	for (int k = order - 1; k >= MINBUDDYORDER; k--) {
+		uint32_t size = 1 << (k - MINBUDDYORDER);
+		if (units & size) {
+			if (off != 0) {
+				SetBit(tailMap[k], (idx + off) >> (k - MINBUDDYORDER));
+			}
+			SetBit(allocMap[k], (idx + off) >> (k - MINBUDDYORDER));
+			off += size;
+		}
+	}
+	while (off < (1U << (order - MINBUDDYORDER))) {
+		int k = MINBUDDYORDER + __builtin_ctz(off);
+		BuddyPush(idx + off, k);
+		off += 1 << (k - MINBUDDYORDER);
+	}
+}
 
-uint32_t firstFreeBFLE;
+// Cache of calling thread, emptied if it belongs to previous heap
+struct BuddyCache* MyCache(void)
+{
+	struct BuddyCache* c = &buddyCache;
+	if (c->generation != heapGeneration) {
+		for (int k = 0; k <= CACHEORDER; k++) {
+			c->head[k] = BFL_NIL;
+			c->count[k] = 0;
+		}
+		c->generation = heapGeneration;
+	}
+	return c;
+}
 
-void ReserveMemInit(int memSize)
+/*
+	Args:
+	    keep - number of blocks left in cache of each order
+	Merge cached blocks into free lists, buddyMtx is held by caller
+*/
+void CacheFlush(struct BuddyCache* c, int keep)
 {
-	reservedMemory = memory;
-	int nrBFLElements = memSize / MINBUDDYSIZE;
-	int reservedMemSize = nrBFLElements * sizeof(struct BFLElement); 
-	int power = 1;
-	
-	
-	while (power < reservedMemSize) {
-		power *= 2;
+	for (int k = MINBUDDYORDER; k <= CACHEORDER; k++) {
+		while (c->count[k] > keep) {
+			uint32_t idx = c->head[k];
+			c->head[k] = BFLE(idx)->next;
+			c->count[k]--;
+			BuddyFree(idx, k);
+		}
 	}
-	reservedMemSize = power;
-	firstFreeBFLE = 0;
-	for (int i = 0; i < (nrBFLElements - 1); i++) {
-		reservedMemory[i].next = i + 1;
+}
+
+BuddyCache::~BuddyCache()
+{
+	if (generation == heapGeneration) {
+		pthread_mutex_lock(&buddyMtx);
+		CacheFlush(this, 0);
+		pthread_mutex_unlock(&buddyMtx);
 	}
-	reservedMemory[nrBFLElements - 1].next = 0xffffffff;
 }
 
-struct BFLElement* AllocBFLE(void)
+// Merge blocks cached by calling thread
+void   HeapFlush   ( void )
+{
+	pthread_mutex_lock(&buddyMtx);
+	CacheFlush(MyCache(), 0);
+	pthread_mutex_unlock(&buddyMtx);
+}
+
+void * HeapAlloc   ( int    size )
 {
-	if (firstFreeBFLE == 0xffffffff) {
+	if (size <= 0) {
+		return NULL;
+	}
+	// Order of size rounded up to power of two
+	int order = (size <= MINBUDDYSIZE) ? MINBUDDYORDER : 32 - __builtin_clz(size - 1);
+	if (order > maxOrder) {
 		return NULL;
 	}
-	struct BFLElement* res = reservedMemory + firstFreeBFLE;
-	firstFreeBFLE = res->next;
+	if (order <= CACHEORDER) {
+		struct BuddyCache* c = MyCache();
+		if (c->count[order] > 0) {
+			uint32_t idx = c->head[order];
+			c->head[order] = BFLE(idx)->next;
+			c->count[order]--;
+			SetBit(allocMap[order], idx >> (order - MINBUDDYORDER));
+			__atomic_fetch_add(&allocatedBlocks, 1, __ATOMIC_RELAXED);
+			return arena + idx * MINBUDDYSIZE;
+		}
+	}
+	pthread_mutex_lock(&buddyMtx);
+	char* blk = (char*)BuddyAlloc(order);
+	if (blk == NULL) {
+		// Merge blocks cached by this thread and empty slabs only under memory pressure
+		CacheFlush(MyCache(), 0);
+		SlabReclaim();
+		blk = (char*)BuddyAlloc(order);
+	}
+	uint32_t units = (size + MINBUDDYSIZE - 1) / MINBUDDYSIZE;
+	if (blk != NULL && order > TRIMORDER && units < (1U << (order - MINBUDDYORDER))) {
+		BuddyTrim((blk - arena) / MINBUDDYSIZE, order, units);
+	}
+	pthread_mutex_unlock(&buddyMtx);
+	return blk;
+}
 
-	return res;
+/*
+	Args:
+	    idx - index of minimal block
+	    maxK - highest order to try
+	return value:
+	    order of allocated block starting at idx or MINBUDDYORDER - 1,
+	    block is aligned to its size
+*/
+int AllocatedOrder(uint32_t idx, int maxK)
+{
+	for (int order = MINBUDDYORDER; order <= maxK; order++) {
+		uint32_t bit = idx >> (order - MINBUDDYORDER);
+		if ((bit << (order - MINBUDDYORDER)) != idx) {
+			break;
+		}
+		if (TestBit(allocMap[order], bit)) {
+			return order;
+		}
+	}
+	return MINBUDDYORDER - 1;
 }
 
+bool   HeapFree    ( void * blk )
+{
+	if (arenaUnits == 0 || (char*)blk < arena || (char*)blk >= arena + arenaUnits * MINBUDDYSIZE) {
+		return false;
+	}
+	if (((char*)blk - arena) % MINBUDDYSIZE != 0) {
+		return false;
+	}
+	uint32_t idx = ((char*)blk - arena) / MINBUDDYSIZE;
+	int order = AllocatedOrder(idx, CACHEORDER);
+	if (order >= MINBUDDYORDER) {
+		// Block goes to cache of thread without merging
+		if (TestBit(tailMap[order], idx >> (order - MINBUDDYORDER)) ||
+		    !ClearBit(allocMap[order], idx >> (order - MINBUDDYORDER))) {
+			return false;
+		}
+		__atomic_fetch_sub(&allocatedBlocks, 1, __ATOMIC_RELAXED);
+		struct BuddyCache* c = MyCache();
+		BFLE(idx)->next = c->head[order];
+		c->head[order] = idx;
+		if (++c->count[order] > CACHE_BLOCKS) {
+			pthread_mutex_lock(&buddyMtx);
+			CacheFlush(c, CACHE_BLOCKS / 2);
+			pthread_mutex_unlock(&buddyMtx);
+		}
+		return true;
+	}
+	pthread_mutex_lock(&buddyMtx);
+	order = AllocatedOrder(idx, maxOrder);
+	if (order < MINBUDDYORDER || TestBit(tailMap[order], idx >> (order - MINBUDDYORDER))) {
+		pthread_mutex_unlock(&buddyMtx);
+		return false;
+	}
+	__atomic_fetch_sub(&allocatedBlocks, 1, __ATOMIC_RELAXED);
+	// Free blocks of trimmed allocation, each following block has lower order
+	while (order >= MINBUDDYORDER) {
+		BuddyFree(idx, order);
+		idx += 1 << (order - MINBUDDYORDER);
+		if (idx >= arenaUnits) {
+			break;
+		}
+		order = AllocatedOrder(idx, order - 1);
+		if (order < MINBUDDYORDER || !TestBit(tailMap[order], idx >> (order - MINBUDDYORDER))) {
+			break;
+		}
+		ClearBit(tailMap[order], idx >> (order - MINBUDDYORDER));
+	}
+	pthread_mutex_unlock(&buddyMtx);
+	return true;
+}
 
-void* FreeBFLE(struct BFLElement* el)
+void   HeapDone    ( int  * pendingBlk )
 {
-	el->next = firstFreeBFLE;
-	firstFreeBFLE = el - reservedMemory;
+	*pendingBlk = __atomic_load_n(&allocatedBlocks, __ATOMIC_RELAXED);
 }
 
-void   HeapInit    ( void * memPool, int memSize )
+/*
+	Args:
+	    blk - start of allocation
+	return value:
+	    bytes granted to allocation: its block or blocks of trimmed allocation,
+	    0 if blk is not start of allocation
+*/
+int    HeapBlockSize ( void * blk )
 {
-	memory = memPool;
-	int power = 1;
-	int order = 0;	
-	
-	while (power < memSize) {
-		power *= 2;
-		order++;
+	if (arenaUnits == 0 || (char*)blk < arena || (char*)blk >= arena + arenaUnits * MINBUDDYSIZE) {
+		return 0;
+	}
+	if (((char*)blk - arena) % MINBUDDYSIZE != 0) {
+		return 0;
+	}
+	uint32_t idx = ((char*)blk - arena) / MINBUDDYSIZE;
+	int size = 0;
+	pthread_mutex_lock(&buddyMtx);
+	int order = AllocatedOrder(idx, maxOrder);
+	if (order >= MINBUDDYORDER && !TestBit(tailMap[order], idx >> (order - MINBUDDYORDER))) {
+		while (order >= MINBUDDYORDER) {
+			size += 1 << order;
+			idx += 1 << (order - MINBUDDYORDER);
+			if (idx >= arenaUnits) {
+				break;
+			}
+			order = AllocatedOrder(idx, order - 1);
+			if (order < MINBUDDYORDER || !TestBit(tailMap[order], idx >> (order - MINBUDDYORDER))) {
+				break;
+			}
+		}
 	}
+	pthread_mutex_unlock(&buddyMtx);
+	return size;
+}
+
+// Bytes available for allocation in empty heap
+int    HeapCapacity ( void )
+{
+	return arenaUnits * MINBUDDYSIZE;
+}
+
+/*
+	Slab cache of objects of one size. Slab is buddy block of order SLAB_ORDER,
+	it is aligned to its size inside arena, so slab of object is found by
+	masking offset of object. Slab starts with struct BuddySlab, objects follow
+	it shifted by colour of slab, so that objects of different slabs do not
+	compete for the same cache lines.
+*/
+struct BuddySlab {
+	uint32_t magic;
+	int freeObjects;
+	int nrObjects;
+	// Offset of first object from start of slab
+	int firstObject;
+	struct SlabCache* cache;
+	struct BuddySlab* next;
+	struct BuddySlab* prev;
+	// Bit i is set if i-th object is free
+	uint64_t freeMap[SLAB_MAP_WORDS];
+};
 
+struct SlabCache {
+	int size;
+	int align;
+	// Colour of next slab and number of colours
+	int colourNext;
+	int colours;
+	// Slabs with free and used objects
+	struct BuddySlab* partial;
+	// Slabs without used objects, at most SLAB_EMPTY_MAX
+	struct BuddySlab* empty;
+	int nrEmpty;
+	// Number of allocated objects
+	int objects;
+	pthread_mutex_t mtx;
+	// List of all caches, protected by buddyMtx
+	struct SlabCache* nextCache;
+};
 
-	// Init memory and call function for initialization
-	PrintBuddyList(freeBuddyList, "Free buddy list");	
-	
-	PrintBuddyList(usedBuddyList, "Used buddy list");
-       
+void SlabUnlink(struct BuddySlab** list, struct BuddySlab* slab)
+{
+	if (slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		*list = slab->next;
+	}
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
 }
 
-void* BuddyAlloc(int order) {
-	struct BFLElement* tmp;
-	struct BFLElement* cur;
-	struct BFLElement* prev;
+void SlabPush(struct BuddySlab** list, struct BuddySlab* slab)
+{
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = slab;
+	}
+	*list = slab;
+}
 
-	for (int i = order; i < maxOrder; i++) {
-		if (freeBuddyList[i] == NULL) {
-			continue;
+/*
+	Args:
+	    size - size of objects, at most SLAB_MAX_SIZE
+	    align - alignment of objects, power of two
+	return value:
+	    new cache allocated from buddy heap or NULL
+*/
+struct SlabCache* SlabCacheCreate(int size, int align)
+{
+	if (size <= 0 || size > SLAB_MAX_SIZE || align <= 0 || (align & (align - 1)) != 0 || align > SLAB_SIZE / 8) {
+		return NULL;
+	}
+	struct SlabCache* cache = (struct SlabCache*)HeapAlloc(sizeof(struct SlabCache));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->align = (align < 8) ? 8 : align;
+	cache->size = (size + cache->align - 1) & ~(cache->align - 1);
+	// Space left in slab by objects is used for colouring
+	int objects = (SLAB_SIZE - sizeof(struct BuddySlab) - cache->align + 1) / cache->size;
+	if (objects > SLAB_MAP_WORDS * 64) {
+		objects = SLAB_MAP_WORDS * 64;
+	}
+	int step = (cache->align > SLAB_COLOUR) ? cache->align : SLAB_COLOUR;
+	cache->colours = (SLAB_SIZE - sizeof(struct BuddySlab) - cache->align + 1 - objects * cache->size) / step + 1;
+	cache->colourNext = 0;
+	cache->partial = NULL;
+	cache->empty = NULL;
+	cache->nrEmpty = 0;
+	cache->objects = 0;
+	pthread_mutex_init(&cache->mtx, NULL);
+	pthread_mutex_lock(&buddyMtx);
+	cache->nextCache = slabCaches;
+	slabCaches = cache;
+	pthread_mutex_unlock(&buddyMtx);
+	return cache;
+}
+
+// Allocate new slab of cache, cache->mtx is held
+struct BuddySlab* SlabNew(struct SlabCache* cache)
+{
+	struct BuddySlab* slab = (struct BuddySlab*)HeapAlloc(SLAB_SIZE);
+	if (slab == NULL) {
+		return NULL;
+	}
+	int step = (cache->align > SLAB_COLOUR) ? cache->align : SLAB_COLOUR;
+	uintptr_t first = ((uintptr_t)(slab + 1) + cache->align - 1) & ~(uintptr_t)(cache->align - 1);
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->firstObject = first - (uintptr_t)slab + cache->colourNext * step;
+	slab->nrObjects = (SLAB_SIZE - slab->firstObject) / cache->size;
+	if (slab->nrObjects > SLAB_MAP_WORDS * 64) {
+		slab->nrObjects = SLAB_MAP_WORDS * 64;
+	}
+	slab->freeObjects = slab->nrObjects;
+	for (int w = 0; w < SLAB_MAP_WORDS; w++) {
+		int n = slab->nrObjects - w * 64;
+		slab->freeMap[w] = (n >= 64) ? ~0ULL : (n > 0) ? (1ULL << n) - 1 : 0;
+	}
+	cache->colourNext = (cache->colourNext + 1) % cache->colours;
+	return slab;
+}
+
+void* SlabAlloc(struct SlabCache* cache)
+{
+	pthread_mutex_lock(&cache->mtx);
+	struct BuddySlab* slab = cache->partial;
+	if (slab == NULL) {
+		if (cache->empty != NULL) {
+			slab = cache->empty;
+			SlabUnlink(&cache->empty, slab);
+			cache->nrEmpty--;
+		} else if ((slab = SlabNew(cache)) == NULL) {
+			pthread_mutex_unlock(&cache->mtx);
+			return NULL;
 		}
-		if (i == order) {
-			  tmp = freeBuddyList[i];
-			  freeBuddyList[i] = tmp->next;
-			  // Insert tmp to used buddy list
-			  cur = usedBuddyList[i];  
-			  while (cur != NULL) {
-				  if (cur->address < tmp->address) {
-					  prev = cur;
-					  cur = cur->next;
-					  continue;
-				  }
-				  break;
-			  }
-			  tmp->next = prev->next;
-			  prev->next = tmp;
-			  return (char*)memory + (1 << order) * tmp->address;
+		SlabPush(&cache->partial, slab);
+	}
+	int w = 0;
+	while (slab->freeMap[w] == 0) {
+		w++;
+	}
+	int obj = w * 64 + __builtin_ctzll(slab->freeMap[w]);
+	slab->freeMap[w] &= slab->freeMap[w] - 1;
+	cache->objects++;
+	if (--slab->freeObjects == 0) {
+		// Full slabs are not linked
+		SlabUnlink(&cache->partial, slab);
+	}
+	pthread_mutex_unlock(&cache->mtx);
+	return (char*)slab + slab->firstObject + obj * cache->size;
+}
+
+/*
+	Args:
+	    obj - object allocated by SlabAlloc from cache
+	return value:
+	    false if obj is not allocated object of cache
+*/
+bool SlabFree(struct SlabCache* cache, void* obj)
+{
+	if (arenaUnits == 0 || (char*)obj < arena || (char*)obj >= arena + arenaUnits * MINBUDDYSIZE) {
+		return false;
+	}
+	uint32_t idx = (((char*)obj - arena) & ~(SLAB_SIZE - 1)) / MINBUDDYSIZE;
+	struct BuddySlab* slab = (struct BuddySlab*)(arena + idx * MINBUDDYSIZE);
+	pthread_mutex_lock(&cache->mtx);
+	if (!TestBit(allocMap[SLAB_ORDER], idx >> (SLAB_ORDER - MINBUDDYORDER)) ||
+	    slab->magic != SLAB_MAGIC || slab->cache != cache) {
+		pthread_mutex_unlock(&cache->mtx);
+		return false;
+	}
+	int offset = (char*)obj - (char*)slab - slab->firstObject;
+	int obj_nr = offset / cache->size;
+	uint64_t bit = 1ULL << (obj_nr % 64);
+	if (offset < 0 || offset % cache->size != 0 || obj_nr >= slab->nrObjects ||
+	    (slab->freeMap[obj_nr / 64] & bit) != 0) {
+		pthread_mutex_unlock(&cache->mtx);
+		return false;
+	}
+	slab->freeMap[obj_nr / 64] |= bit;
+	cache->objects--;
+	if (++slab->freeObjects == 1) {
+		SlabPush(&cache->partial, slab);
+	}
+	if (slab->freeObjects == slab->nrObjects) {
+		SlabUnlink(&cache->partial, slab);
+		if (cache->nrEmpty < SLAB_EMPTY_MAX) {
+			SlabPush(&cache->empty, slab);
+			cache->nrEmpty++;
+		} else {
+			slab->magic = 0;
+			HeapFree(slab);
 		}
 	}
-	return NULL;
+	pthread_mutex_unlock(&cache->mtx);
+	return true;
 }
 
-void * HeapAlloc   ( int    size )
+/*
+	Free empty slabs of cache, buddyMtx and cache->mtx are held
+	return value:
+	    number of freed slabs
+*/
+int SlabShrinkLocked(struct SlabCache* cache)
 {
-	return NULL;
+	int freed = 0;
+	while (cache->empty != NULL) {
+		struct BuddySlab* slab = cache->empty;
+		SlabUnlink(&cache->empty, slab);
+		slab->magic = 0;
+		BuddyFree(((char*)slab - arena) / MINBUDDYSIZE, SLAB_ORDER);
+		__atomic_fetch_sub(&allocatedBlocks, 1, __ATOMIC_RELAXED);
+		freed++;
+	}
+	cache->nrEmpty = 0;
+	return freed;
 }
-bool   HeapFree    ( void * blk )
+
+int SlabShrink(struct SlabCache* cache)
 {
-	return false;
+	pthread_mutex_lock(&cache->mtx);
+	pthread_mutex_lock(&buddyMtx);
+	int freed = SlabShrinkLocked(cache);
+	pthread_mutex_unlock(&buddyMtx);
+	pthread_mutex_unlock(&cache->mtx);
+	return freed;
 }
-void   HeapDone    ( int  * pendingBlk )
+
+/*
+	Called by HeapAlloc under memory pressure with buddyMtx held.
+	Caches locked by other threads are skipped, they lock cache->mtx
+	before buddyMtx.
+*/
+int SlabReclaim(void)
 {
-  /* todo */
+	int freed = 0;
+	for (struct SlabCache* cache = slabCaches; cache != NULL; cache = cache->nextCache) {
+		if (pthread_mutex_trylock(&cache->mtx) == 0) {
+			freed += SlabShrinkLocked(cache);
+			pthread_mutex_unlock(&cache->mtx);
+		}
+	}
+	return freed;
+}
+
+/*
+	return value:
+	    false if cache still has allocated objects, cache is not destroyed then
+*/
+bool SlabCacheDestroy(struct SlabCache* cache)
+{
+	pthread_mutex_lock(&cache->mtx);
+	if (cache->objects != 0) {
+		pthread_mutex_unlock(&cache->mtx);
+		return false;
+	}
+	pthread_mutex_unlock(&cache->mtx);
+	SlabShrink(cache);
+	pthread_mutex_lock(&buddyMtx);
+	struct SlabCache** prev = &slabCaches;
+	while (*prev != cache) {
+		prev = &(*prev)->nextCache;
+	}
+	*prev = cache->nextCache;
+	pthread_mutex_unlock(&buddyMtx);
+	pthread_mutex_destroy(&cache->mtx);
+	HeapFree(cache);
+	return true;
 }
 
 #ifndef __PROGTEST__
+#define TEST_THREADS 4
+#define TEST_BLOCKS 64
+
+/*
+  Thread allocates and frees blocks of random sizes,
+  blocks are checked to keep their contents
+*/
+static void       * threadTest ( void * arg )
+{
+  uint8_t       * blocks[TEST_BLOCKS] = { NULL };
+  int             sizes[TEST_BLOCKS];
+  unsigned        seed = (uintptr_t) arg;
+
+  for ( int i = 0; i < 20000; i ++ )
+  {
+    int k = rand_r ( &seed ) % TEST_BLOCKS;
+    if ( blocks[k] )
+    {
+      for ( int j = 0; j < sizes[k]; j += 16 )
+        assert ( blocks[k][j] == (uint8_t) k );
+      assert ( HeapFree ( blocks[k] ) );
+      blocks[k] = NULL;
+    }
+    else
+    {
+      sizes[k] = ( rand_r ( &seed ) % 8 ) ? 1 + rand_r ( &seed ) % 2048 : 1 + rand_r ( &seed ) % 20000;
+      if ( ( blocks[k] = (uint8_t*) HeapAlloc ( sizes[k] ) ) != NULL )
+        memset ( blocks[k], k, sizes[k] );
+    }
+  }
+  for ( int k = 0; k < TEST_BLOCKS; k ++ )
+    if ( blocks[k] )
+      assert ( HeapFree ( blocks[k] ) );
+  return NULL;
+}
+
 int main ( void )
 {
   uint8_t       * p0, *p1, *p2, *p3, *p4;
   int             pendingBlk;
   static uint8_t  memPool[3 * 1048576];
 
+  HeapInit ( memPool, 2 * 1048576 );
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 2000 ) ) != NULL );
+  // 2 KiB block was split from larger block, its buddy follows it
+  assert ( ( p1 = (uint8_t*) HeapAlloc ( 2048 ) ) == p0 + 2048 );
+  assert ( ( p2 = (uint8_t*) HeapAlloc ( 1500 ) ) == p0 + 4096 );
+  assert ( ( p3 = (uint8_t*) HeapAlloc ( 2097152 ) ) == NULL );
+  assert ( ! HeapFree ( p0 + 32 ) );
+  assert ( ! HeapFree ( p2 + 1 ) );
+  assert ( HeapFree ( p0 ) );
+  assert ( ! HeapFree ( p0 ) );
+  assert ( HeapFree ( p2 ) );
+  // last freed block of order 11 is reused from cache of thread
+  assert ( ( p3 = (uint8_t*) HeapAlloc ( 1025 ) ) == p2 );
+  assert ( HeapFree ( p1 ) );
+  assert ( HeapFree ( p3 ) );
+  HeapDone ( &pendingBlk );
+  assert ( pendingBlk == 0 );
+  // blocks were merged back into the block they were split from
+  HeapFlush ();
+  assert ( ( p3 = (uint8_t*) HeapAlloc ( 65536 ) ) == p0 );
+  assert ( HeapFree ( p3 ) );
+  // 1 MiB block gives back its tail
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 1000000 ) ) != NULL );
+  memset ( p0, 0, 1000000 );
+  assert ( ( p1 = (uint8_t*) HeapAlloc ( 30000 ) ) >= p0 + 1000000 );
+  assert ( p1 < p0 + 1048576 );
+  assert ( ! HeapFree ( p0 + 524288 ) );
+  assert ( HeapFree ( p0 ) );
+  assert ( HeapFree ( p1 ) );
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 1048576 ) ) != NULL );
+  HeapDone ( &pendingBlk );
+  assert ( pendingBlk == 1 );
+
+
   HeapInit ( memPool, 2 * 1048576);
-  return 0;
   assert ( ( p0 = (uint8_t*) HeapAlloc ( 512000 ) ) != NULL );
   memset ( p0, 0, 512000 );
   assert ( ( p1 = (uint8_t*) HeapAlloc ( 511000 ) ) != NULL );
@@ -262,6 +937,62 @@ int main ( void )
   assert ( pendingBlk == 1 );
 
 
+  struct SlabCache * cache;
+  uint8_t       * objs[1000];
+  int             nObjs;
+  HeapInit ( memPool, 2097152 );
+  assert ( ( cache = SlabCacheCreate ( 48, 16 ) ) != NULL );
+  for ( int i = 0; i < 1000; i ++ )
+  {
+    assert ( ( objs[i] = (uint8_t*) SlabAlloc ( cache ) ) != NULL );
+    assert ( ( (uintptr_t) objs[i] & 15 ) == 0 );
+    memset ( objs[i], i, 48 );
+  }
+  // 48 byte objects are packed into 4 KiB slabs, they take less than 64 byte blocks
+  HeapDone ( &pendingBlk );
+  assert ( pendingBlk - 1 < 1000 * 64 / 4096 );
+  // first objects of slabs are coloured differently
+  assert ( ( (uintptr_t) objs[0] & 4095 ) != ( (uintptr_t) objs[999] & 4095 ) );
+  assert ( ! SlabFree ( cache, objs[0] + 8 ) );
+  assert ( ! SlabCacheDestroy ( cache ) );
+  for ( int i = 0; i < 1000; i ++ )
+  {
+    assert ( objs[i][47] == (uint8_t) i );
+    assert ( SlabFree ( cache, objs[i] ) );
+  }
+  assert ( ! SlabFree ( cache, objs[0] ) );
+  // one empty slab is kept
+  assert ( SlabShrink ( cache ) == 1 );
+  assert ( SlabCacheDestroy ( cache ) );
+  HeapDone ( &pendingBlk );
+  assert ( pendingBlk == 0 );
+
+
+  // empty slabs are returned to heap under memory pressure
+  HeapInit ( memPool, 70000 );
+  assert ( ( cache = SlabCacheCreate ( 100, 8 ) ) != NULL );
+  for ( nObjs = 0; ( objs[nObjs] = (uint8_t*) SlabAlloc ( cache ) ) != NULL; nObjs ++ )
+    ;
+  for ( int i = 0; i < nObjs; i ++ )
+    assert ( SlabFree ( cache, objs[i] ) );
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 65536 ) ) != NULL );
+  assert ( HeapFree ( p0 ) );
+  assert ( SlabCacheDestroy ( cache ) );
+
+
+  pthread_t       threads[TEST_THREADS];
+  HeapInit ( memPool, 2097152 );
+  for ( int i = 0; i < TEST_THREADS; i ++ )
+    pthread_create ( &threads[i], NULL, threadTest, (void *)(intptr_t) i );
+  for ( int i = 0; i < TEST_THREADS; i ++ )
+    pthread_join ( threads[i], NULL );
+  HeapDone ( &pendingBlk );
+  assert ( pendingBlk == 0 );
+  // caches of finished threads were merged
+  assert ( ( p0 = (uint8_t*) HeapAlloc ( 1048576 ) ) != NULL );
+  assert ( HeapFree ( p0 ) );
+
+
   return 0;
 }
 #endif /* __PROGTEST__ */
@@ -2,6 +2,7 @@
 #define COMMON_H_5872395623940562390452903457234
 
 const uint32_t     PROCESS_MAX = 64;
+const uint32_t     SWAP_DEVICE_MAX = 8;
 
 class CCPU
 {
@@ -54,6 +55,38 @@ class CCPU
       memAccessEnd ();
       return addr != nullptr;
     }
+    //---------------------------------------------------------------------------------------------
+    // fault in all pages of range [address, address + length) in one memory access
+    virtual bool             populate                      ( uint32_t          address,
+                                                             uint32_t          length,
+                                                             bool              write )
+    {
+      if ( length == 0 )
+        return true;
+      if ( address + length - 1 < address )
+        return false; // wraps around
+      
+      uint32_t pages = (((address + length - 1) & ADDR_MASK) - (address & ADDR_MASK)) / PAGE_SIZE + 1;
+      bool res = true;
+      memAccessStart ();
+      for ( uint32_t i = 0; i < pages && res; i ++ )
+        res = virtual2Physical ( (address & ADDR_MASK) + i * PAGE_SIZE, write ) != nullptr;
+      memAccessEnd ();
+      return res;
+    }
+    //---------------------------------------------------------------------------------------------
+    // populate range and keep its pages resident until unlock, not supported by default
+    virtual bool             lock                          ( uint32_t          address,
+                                                             uint32_t          length )
+    {
+      return false;
+    }
+    //---------------------------------------------------------------------------------------------
+    virtual bool             unlock                        ( uint32_t          address,
+                                                             uint32_t          length )
+    {
+      return false;
+    }
   protected:
     //---------------------------------------------------------------------------------------------
     uint32_t               * virtual2Physical              ( uint32_t          address,
@@ -101,6 +134,18 @@ class CCPU
     uint32_t                 m_PageTableRoot;
 };
 
+struct CSwapDevice
+{
+  // number of pages the device can hold
+  uint32_t                 m_Pages;
+  // higher priority devices are filled first, devices of equal priority are striped
+  int                      m_Priority;
+  bool                  (* m_ReadPage )                    ( uint32_t          memFrame,
+                                                             uint32_t          diskPage );
+  bool                  (* m_WritePage )                   ( uint32_t          memFrame,
+                                                             uint32_t          diskPage );
+};
+
 void               memMgr                                  ( void            * mem,
                                                              uint32_t          memPages,
                                                              uint32_t          diskPages,
@@ -109,4 +154,18 @@ void               memMgr                                  ( void            * m
                                                              void            * processArg,
                                                              void           (* mainProcess) ( CCPU *, void * ) );
 
+void               memMgr                                  ( void            * mem,
+                                                             uint32_t          memPages,
+                                                             const CSwapDevice * swapDevices,
+                                                             uint32_t          swapDeviceCount,
+                                                             void            * processArg,
+                                                             void           (* mainProcess) ( CCPU *, void * ) );
+
+// block of 1 << order contiguous frames of memory of running memMgr, pages of processes are moved
+// or swapped out to make room for it, returns first frame of block or UINT32_MAX
+uint32_t           memAllocFrames                          ( uint32_t          order );
+
+void               memFreeFrames                           ( uint32_t          frame,
+                                                             uint32_t          order );
+
 #endif /* COMMON_H_5872395623940562390452903457234 */
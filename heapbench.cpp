@@ -0,0 +1,314 @@
+/*
+  Benchmark of heap allocators implementing HeapInit / HeapAlloc / HeapFree / HeapDone.
+  Allocator source is selected at compile time:
+
+    g++ -DHEAP_SOURCE='"bitmapmm.cpp"' heapbench.cpp -o bench_bitmapmm
+
+  Usage: bench_xxx [-n ops] [-t trace] ...
+  Trace file has one operation per line: "a <id> <size>" allocates block <id>,
+  "f <id>" frees it. Ids are 0 .. MAX_ID - 1.
+
+  Allocator reports bytes granted to a block by HeapBlockSize and bytes it can
+  hand out by HeapCapacity, fragmentation is measured with them.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <pthread.h>
+using namespace std;
+
+#define __PROGTEST__
+#ifndef HEAP_SOURCE
+#define HEAP_SOURCE "bitmapmm.cpp"
+#endif
+#include HEAP_SOURCE
+
+const int POOL_SIZE    = 4 * 1048576;
+// Number of samples of external fragmentation per run
+const int FRAG_SAMPLES = 16;
+// Ids of trace are indexes of table of live blocks
+const int MAX_ID       = 16 * 1048576;
+
+static uint8_t     g_Pool [ POOL_SIZE ];
+//-------------------------------------------------------------------------------------------------
+// Deterministic random numbers, all allocators replay the same operations
+static uint64_t    g_Seed;
+
+static uint32_t    nextRand                                ( void )
+{
+  g_Seed ^= g_Seed << 13;
+  g_Seed ^= g_Seed >> 7;
+  g_Seed ^= g_Seed << 17;
+  return (uint32_t) ( g_Seed >> 16 );
+}
+//-------------------------------------------------------------------------------------------------
+struct TOp
+{
+  // size > 0 allocates block id, size == 0 frees it
+  int                m_Id;
+  int                m_Size;
+};
+
+struct TLive
+{
+  uint8_t          * m_Blk;
+  int                m_Size;
+  // Bytes granted by allocator, size rounded up to its units or blocks
+  int                m_Granted;
+};
+//-------------------------------------------------------------------------------------------------
+// Random lifetimes: allocate or free random live block with equal probability,
+// at most maxLive blocks are live
+static vector<TOp> randomTrace                             ( int               ops,
+                                                             int               maxLive,
+                                                             int               minSize,
+                                                             int               maxSize )
+{
+  vector<TOp> trace;
+  vector<int> live;
+  int         nextId = 0;
+
+  for ( int i = 0; i < ops; i ++ )
+  {
+    if ( live . empty () || ( (int) live . size () < maxLive && nextRand () % 2 ) )
+    {
+      trace . push_back ( { nextId, minSize + (int) ( nextRand () % ( maxSize - minSize + 1 ) ) } );
+      live . push_back ( nextId ++ );
+    }
+    else
+    {
+      int k = nextRand () % live . size ();
+      trace . push_back ( { live[k], 0 } );
+      live[k] = live . back ();
+      live . pop_back ();
+    }
+  }
+  return trace;
+}
+//-------------------------------------------------------------------------------------------------
+// Mostly small blocks, sizes spread over powers of two up to 64 KiB
+static vector<TOp> mixedTrace                              ( int               ops,
+                                                             int               maxLive )
+{
+  vector<TOp> trace = randomTrace ( ops, maxLive, 1, 1 );
+
+  for ( auto & op : trace )
+    if ( op . m_Size )
+    {
+      int order = 3 + nextRand () % 14;
+      // Small blocks are more frequent
+      if ( nextRand () % 4 )
+        order = 3 + order % 6;
+      op . m_Size = ( 1 << order ) + nextRand () % ( 1 << order );
+    }
+  return trace;
+}
+//-------------------------------------------------------------------------------------------------
+// Producer / consumer: blocks are freed in allocation order by a queue of given depth
+static vector<TOp> fifoTrace                               ( int               ops,
+                                                             int               depth )
+{
+  vector<TOp> trace;
+  deque<int>  queue;
+  int         nextId = 0;
+
+  while ( (int) trace . size () < ops )
+  {
+    if ( (int) queue . size () == depth || ( ! queue . empty () && nextRand () % 3 == 0 ) )
+    {
+      trace . push_back ( { queue . front (), 0 } );
+      queue . pop_front ();
+    }
+    else
+    {
+      trace . push_back ( { nextId, 16 + (int) ( nextRand () % 4096 ) } );
+      queue . push_back ( nextId ++ );
+    }
+  }
+  return trace;
+}
+//-------------------------------------------------------------------------------------------------
+static bool        loadTrace                               ( const char      * fileName,
+                                                             vector<TOp>     & trace )
+{
+  FILE * fp = fopen ( fileName, "r" );
+  char   op;
+  int    id, size;
+
+  if ( ! fp )
+    return false;
+  while ( fscanf ( fp, " %c %d", &op, &id ) == 2 )
+  {
+    if ( id < 0 || id >= MAX_ID )
+      break;
+    if ( op == 'a' && fscanf ( fp, "%d", &size ) == 1 && size > 0 )
+      trace . push_back ( { id, size } );
+    else if ( op == 'f' )
+      trace . push_back ( { id, 0 } );
+    else
+      break;
+  }
+  // Whole file is read, it has at least one operation
+  bool res = feof ( fp ) && ! trace . empty ();
+  fclose ( fp );
+  return res;
+}
+//-------------------------------------------------------------------------------------------------
+/*
+  Largest block allocator can hand out now, found by binary search with HeapAlloc / HeapFree
+*/
+static int         largestBlock                            ( void )
+{
+  int lo = 0, hi = POOL_SIZE;
+
+  while ( lo < hi )
+  {
+    int   mid = lo + ( hi - lo + 1 ) / 2;
+    void * blk = HeapAlloc ( mid );
+    if ( blk )
+    {
+      HeapFree ( blk );
+      lo = mid;
+    }
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+//-------------------------------------------------------------------------------------------------
+static void        runTrace                                ( const char      * name,
+                                                             const vector<TOp> & trace )
+{
+  vector<TLive>  live;
+  vector<double> latency;
+  int            allocs = 0, failures = 0, pendingBlk;
+  long           liveBytes = 0, liveGranted = 0, peakGranted = 0;
+  long           requested = 0, granted = 0;
+  double         extFrag = 0;
+  int            extSamples = 0;
+  double         total = 0;
+
+  for ( auto & op : trace )
+    if ( op . m_Id >= (int) live . size () )
+      live . resize ( op . m_Id + 1, { nullptr, 0, 0 } );
+  latency . reserve ( trace . size () );
+
+  HeapInit ( g_Pool, POOL_SIZE );
+  for ( size_t i = 0; i < trace . size (); i ++ )
+  {
+    const TOp & op = trace[i];
+    TLive     & blk = live[op . m_Id];
+
+    if ( ( op . m_Size == 0 ) == ( blk . m_Blk == nullptr ) )
+      // Allocation of block failed before or trace allocates live block again
+      continue;
+
+    auto start = chrono::steady_clock::now ();
+    if ( op . m_Size )
+      blk . m_Blk = (uint8_t *) HeapAlloc ( op . m_Size );
+    else if ( ! HeapFree ( blk . m_Blk ) )
+      abort ();
+    auto end = chrono::steady_clock::now ();
+    double ns = chrono::duration<double, nano> ( end - start ) . count ();
+    latency . push_back ( ns );
+    total += ns;
+
+    if ( op . m_Size )
+    {
+      allocs ++;
+      if ( blk . m_Blk == nullptr )
+      {
+        failures ++;
+        continue;
+      }
+      blk . m_Size = op . m_Size;
+      blk . m_Granted = HeapBlockSize ( blk . m_Blk );
+      assert ( blk . m_Granted >= op . m_Size );
+      liveBytes += op . m_Size;
+      liveGranted += blk . m_Granted;
+      peakGranted = max ( peakGranted, liveGranted );
+      requested += op . m_Size;
+      granted += blk . m_Granted;
+    }
+    else
+    {
+      liveBytes -= blk . m_Size;
+      liveGranted -= blk . m_Granted;
+      blk . m_Blk = nullptr;
+    }
+
+    // External fragmentation: part of free capacity which can not be allocated as one block
+    long freeBytes = HeapCapacity () - liveGranted;
+    if ( ( i + 1 ) % ( trace . size () / FRAG_SAMPLES + 1 ) == 0 && liveBytes > 0 && freeBytes > 0 )
+    {
+      extFrag += 1.0 - (double) largestBlock () / freeBytes;
+      extSamples ++;
+    }
+  }
+
+  for ( auto & blk : live )
+    if ( blk . m_Blk && ! HeapFree ( blk . m_Blk ) )
+      abort ();
+  HeapDone ( &pendingBlk );
+  assert ( pendingBlk == 0 );
+
+  size_t n = latency . size ();
+  if ( n == 0 )
+  {
+    printf ( "%-10s no operations done\n", name );
+    return;
+  }
+  sort ( latency . begin (), latency . end () );
+  printf ( "%-10s %9.0f ops/s  p50 %6.0f ns  p99 %6.0f ns  p99.9 %7.0f ns  max %8.0f ns\n",
+           name, n / ( total / 1e9 ), latency[n / 2], latency[n * 99 / 100], latency[n * 999 / 1000], latency[n - 1] );
+  // Internal fragmentation: part of granted bytes not requested, over all allocations
+  printf ( "%-10s peak %7ld B  internal %5.1f %%  external %5.1f %%  failed %d / %d (%.2f %%)\n",
+           "", peakGranted,
+           granted ? 100.0 * ( granted - requested ) / granted : 0.0,
+           extSamples ? 100.0 * extFrag / extSamples : 0.0,
+           failures, allocs, allocs ? 100.0 * failures / allocs : 0.0 );
+}
+//-------------------------------------------------------------------------------------------------
+int                main                                    ( int               argc,
+                                                             char            * argv [] )
+{
+  int          ops = 200000;
+  const char * traceFile = nullptr;
+
+  for ( int i = 1; i < argc; i ++ )
+    if ( ! strcmp ( argv[i], "-n" ) && i + 1 < argc )
+      ops = atoi ( argv[++ i] );
+    else if ( ! strcmp ( argv[i], "-t" ) && i + 1 < argc )
+      traceFile = argv[++ i];
+    else
+    {
+      fprintf ( stderr, "Usage: %s [-n ops] [-t trace]\n", argv[0] );
+      return 1;
+    }
+
+  printf ( "%s, pool %d B\n", HEAP_SOURCE, POOL_SIZE );
+  g_Seed = 88172645463325252ULL;
+  runTrace ( "small", randomTrace ( ops, 4096, 8, 256 ) );
+  runTrace ( "mixed", mixedTrace ( ops, 512 ) );
+  runTrace ( "fifo", fifoTrace ( ops, 256 ) );
+  if ( traceFile )
+  {
+    vector<TOp> trace;
+    if ( ! loadTrace ( traceFile, trace ) )
+    {
+      fprintf ( stderr, "Cannot read trace %s: bad line or no operations\n", traceFile );
+      return 1;
+    }
+    runTrace ( traceFile, trace );
+  }
+  return 0;
+}
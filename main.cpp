@@ -6,6 +6,7 @@
 #include <pthread.h>
 #include <cassert>
 #include <semaphore.h>
+#include <unistd.h>
 #include "common.h"
 using namespace std;
 
@@ -19,6 +20,13 @@ uint8_t          * g_MemoryAligned = (uint8_t *) (( ((uintptr_t) g_Memory) + CCP
 FILE             * g_Fp;
 // mutex for swap file (swap read/write functions are thread-safe)
 pthread_mutex_t    g_Mtx;
+// swap-outs to each device of priority test, protected by g_Mtx
+int                g_DevWrites [ 3 ];
+// first word of page locked by lock test 2, swap-outs of it are counted under g_Mtx
+const uint32_t     PIN_MARKER = 0xc0ffee01;
+int                g_PinnedSwaps;
+// short processes of churn test running at once
+sem_t              g_ChurnSem;
 //-------------------------------------------------------------------------------------------------
 static void        seqTest1                                ( CCPU            * cpu,
                                                              void            * arg )
@@ -66,6 +74,83 @@ static void        seqTest2                                ( CCPU            * c
   }
 }
 //-------------------------------------------------------------------------------------------------
+static void        lockTest1                               ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  // 16 pinned pages must survive memory pressure created by seqTest2
+  assert ( cpu -> lock ( 8388608, 16 * CCPU::PAGE_SIZE ) );
+  for ( uint32_t i = 8388608; i < 8388608 + 16 * CCPU::PAGE_SIZE; i += 4 )
+    assert ( cpu -> writeInt ( i, i ^ 0x55aa55aa ) );
+  
+  assert ( cpu -> populate ( 19230400, 20230400 - 19230400, true ) );
+  seqTest2 ( cpu, arg );
+  
+  for ( uint32_t i = 8388608; i < 8388608 + 16 * CCPU::PAGE_SIZE; i += 4 )
+  {
+    uint32_t x;
+    assert ( cpu -> readInt ( i, x ) );
+    assert ( x == ( i ^ 0x55aa55aa ) );
+  }
+  assert ( cpu -> unlock ( 8388608, 16 * CCPU::PAGE_SIZE ) );
+}
+//-------------------------------------------------------------------------------------------------
+static void        lockTest2                               ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  uint32_t x;
+  
+  // page faulted in by read is locked and written in place
+  assert ( cpu -> readInt ( 4096, x ) && x == 0 );
+  assert ( cpu -> lock ( 4096, 4096 ) );
+  assert ( cpu -> writeInt ( 4096, 1234 ) );
+  assert ( cpu -> readInt ( 8192, x ) && x == 0 );
+  assert ( cpu -> writeInt ( 8192, 5678 ) );
+  
+  // overlapping locks, page 1 stays locked after the first range is unlocked
+  assert ( cpu -> lock ( 8388608, 2 * CCPU::PAGE_SIZE ) );
+  assert ( cpu -> lock ( 8388608 + CCPU::PAGE_SIZE, 2 * CCPU::PAGE_SIZE ) );
+  assert ( cpu -> writeInt ( 8388608 + CCPU::PAGE_SIZE, PIN_MARKER ) );
+  assert ( cpu -> unlock ( 8388608, 2 * CCPU::PAGE_SIZE ) );
+  for ( uint32_t i = 0; i < 400; i ++ )
+    assert ( cpu -> writeInt ( 16777216 + i * CCPU::PAGE_SIZE, i ) );
+  assert ( g_PinnedSwaps == 0 );
+  
+  // last lock is dropped, page can be swapped out now
+  assert ( cpu -> unlock ( 8388608 + CCPU::PAGE_SIZE, 2 * CCPU::PAGE_SIZE ) );
+  for ( uint32_t i = 0; i < 400; i ++ )
+    assert ( cpu -> writeInt ( 16777216 + i * CCPU::PAGE_SIZE, i + 1 ) );
+  assert ( g_PinnedSwaps > 0 );
+  assert ( cpu -> readInt ( 8388608 + CCPU::PAGE_SIZE, x ) && x == PIN_MARKER );
+  assert ( cpu -> readInt ( 4096, x ) && x == 1234 );
+  assert ( cpu -> readInt ( 8192, x ) && x == 5678 );
+  assert ( cpu -> unlock ( 4096, 4096 ) );
+}
+//-------------------------------------------------------------------------------------------------
+static void        lockLimitTest                           ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  uint32_t x;
+  
+  // more pages than RAM cannot be locked, no page stays pinned then
+  assert ( ! cpu -> lock ( 8388608, 200 * CCPU::PAGE_SIZE ) );
+  assert ( cpu -> lock ( 8388608, 40 * CCPU::PAGE_SIZE ) );
+  for ( uint32_t i = 0; i < 40; i ++ )
+    assert ( cpu -> writeInt ( 8388608 + i * CCPU::PAGE_SIZE, i ) );
+  
+  // the rest of memory is left for other pages
+  assert ( ! cpu -> lock ( 16777216, 40 * CCPU::PAGE_SIZE ) );
+  for ( uint32_t i = 0; i < 400; i ++ )
+    assert ( cpu -> writeInt ( 16777216 + i * CCPU::PAGE_SIZE, i + 1 ) );
+  for ( uint32_t i = 0; i < 400; i ++ )
+    assert ( cpu -> readInt ( 16777216 + i * CCPU::PAGE_SIZE, x ) && x == i + 1 );
+  
+  assert ( cpu -> unlock ( 8388608, 40 * CCPU::PAGE_SIZE ) );
+  assert ( cpu -> lock ( 16777216, 40 * CCPU::PAGE_SIZE ) );
+  for ( uint32_t i = 0; i < 40; i ++ )
+    assert ( cpu -> readInt ( 8388608 + i * CCPU::PAGE_SIZE, x ) && x == i );
+  assert ( cpu -> unlock ( 16777216, 40 * CCPU::PAGE_SIZE ) );
+}
+//-------------------------------------------------------------------------------------------------
 static void        parTest1                                ( CCPU            * cpu,
                                                              void            * arg )
 {
@@ -74,6 +159,135 @@ static void        parTest1                                ( CCPU            * c
   cpu -> newProcess ( nullptr, seqTest2 );
 }
 //-------------------------------------------------------------------------------------------------
+static void        contentionWorker                        ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  uint32_t id = (uint32_t) (uintptr_t) arg;
+  
+  for ( uint32_t i = 0; i < 40; i ++ )
+    assert ( cpu -> writeInt ( i * CCPU::PAGE_SIZE, i ^ ( id << 16 ) ) );
+  for ( uint32_t i = 0; i < 40; i ++ )
+  {
+    uint32_t x;
+    assert ( cpu -> readInt ( i * CCPU::PAGE_SIZE, x ) );
+    assert ( x == ( i ^ ( id << 16 ) ) );
+  }
+}
+//-------------------------------------------------------------------------------------------------
+// more processes than evictable frames, so that all victims are often in flight at once
+static void        contentionTest                          ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  for ( uintptr_t i = 0; i < 8; i ++ )
+    assert ( cpu -> newProcess ( (void *) i, contentionWorker ) );
+}
+//-------------------------------------------------------------------------------------------------
+static void        churnShort                              ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  assert ( cpu -> writeInt ( 0, 1 ) );
+  sem_post ( &g_ChurnSem );
+}
+//-------------------------------------------------------------------------------------------------
+static void        churnSpawner                            ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  for ( uint32_t i = 0; i < 200; i ++ )
+  {
+    sem_wait ( &g_ChurnSem );
+    assert ( cpu -> newProcess ( nullptr, churnShort ) );
+  }
+}
+//-------------------------------------------------------------------------------------------------
+// short processes exit while others fault, memory of exiting processes is neither
+// evictable nor free until it is returned
+static void        churnTest                               ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  for ( uintptr_t i = 0; i < 2; i ++ )
+    assert ( cpu -> newProcess ( (void *) i, contentionWorker ) );
+  assert ( cpu -> newProcess ( nullptr, churnSpawner ) );
+}
+//-------------------------------------------------------------------------------------------------
+// pages are only written, so swap slots are never freed and devices fill up in order
+static void        priorityTest                            ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  for ( uint32_t i = 0; i < 400; i ++ )
+    assert ( cpu -> writeInt ( i * CCPU::PAGE_SIZE, i ) );
+}
+//-------------------------------------------------------------------------------------------------
+// blocks of orders 1 .. 4 are allocated, pages in their way must keep their data
+static void        compactionBlocks                        ( CCPU            * cpu,
+                                                             uint32_t          pages,
+                                                             uint32_t          seed )
+{
+  uint32_t blocks [ 5 ];
+  
+  for ( uint32_t order = 1; order <= 4; order ++ )
+  {
+    blocks[order] = memAllocFrames ( order );
+    assert ( blocks[order] != UINT32_MAX && blocks[order] % ( 1U << order ) == 0 );
+    memset ( g_MemoryAligned + blocks[order] * CCPU::PAGE_SIZE, 0xcc, CCPU::PAGE_SIZE << order );
+  }
+  for ( uint32_t i = 0; i < pages; i ++ )
+  {
+    uint32_t x;
+    assert ( cpu -> readInt ( i * CCPU::PAGE_SIZE, x ) );
+    assert ( x == i * seed + 1 );
+  }
+  for ( uint32_t order = 1; order <= 4; order ++ )
+    memFreeFrames ( blocks[order], order );
+}
+//-------------------------------------------------------------------------------------------------
+static void        compactionTest                          ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  uint32_t held [ 128 ], heldNum = 0;
+  
+  // every other frame is held, pages fault into the frames between them
+  while ( heldNum < 128 && ( held[heldNum] = memAllocFrames ( 0 ) ) != UINT32_MAX )
+    heldNum ++;
+  for ( uint32_t i = 0; i < heldNum; i += 2 )
+    memFreeFrames ( held[i], 0 );
+  for ( uint32_t i = 0; i < heldNum / 2 - 4; i ++ )
+    assert ( cpu -> writeInt ( i * CCPU::PAGE_SIZE, i * 7 + 1 ) );
+  for ( uint32_t i = 1; i < heldNum; i += 2 )
+    memFreeFrames ( held[i], 0 );
+  compactionBlocks ( cpu, heldNum / 2 - 4, 7 );
+  
+  // more pages than frames, frames are all resident and pages must be swapped out
+  for ( uint32_t i = 0; i < 200; i ++ )
+    assert ( cpu -> writeInt ( i * CCPU::PAGE_SIZE, i * 13 + 1 ) );
+  compactionBlocks ( cpu, 200, 13 );
+}
+//-------------------------------------------------------------------------------------------------
+static void        compactionWorker                        ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  for ( uint32_t i = 0; i < 300; i ++ )
+  {
+    uint32_t order = 1 + i % 3;
+    uint32_t block = memAllocFrames ( order );
+    if ( block != UINT32_MAX )
+    {
+      memset ( g_MemoryAligned + block * CCPU::PAGE_SIZE, 0xcc, CCPU::PAGE_SIZE << order );
+      memFreeFrames ( block, order );
+    }
+    assert ( cpu -> writeInt ( i % 20 * CCPU::PAGE_SIZE, i ) );
+  }
+}
+//-------------------------------------------------------------------------------------------------
+// blocks are compacted while other processes fault, their pages must keep their data
+static void        compactionParTest                       ( CCPU            * cpu,
+                                                             void            * arg )
+{
+  for ( uintptr_t i = 0; i < 3; i ++ )
+    assert ( cpu -> newProcess ( (void *) i, contentionWorker ) );
+  assert ( cpu -> newProcess ( nullptr, compactionWorker ) );
+  assert ( cpu -> newProcess ( nullptr, compactionWorker ) );
+}
+//-------------------------------------------------------------------------------------------------
 bool               fnReadPage                              ( uint32_t          memFrame,
                                                              uint32_t          diskPage )
 {
@@ -94,6 +308,88 @@ bool               fnWritePage                             ( uint32_t          m
   return res;
 }
 //-------------------------------------------------------------------------------------------------
+bool               fnWritePagePin                          ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  pthread_mutex_lock ( &g_Mtx );
+  if ( * (uint32_t *) ( g_MemoryAligned + memFrame * CCPU::PAGE_SIZE ) == PIN_MARKER )
+    g_PinnedSwaps ++;
+  pthread_mutex_unlock ( &g_Mtx );
+  return fnWritePage ( memFrame, diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+// second and third swap device live past the first one in the same swap file
+bool               fnReadPage2                             ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  return fnReadPage ( memFrame, DISK_PAGES + diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnWritePage2                            ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  return fnWritePage ( memFrame, DISK_PAGES + diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnReadPage3                             ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  return fnReadPage ( memFrame, 2 * DISK_PAGES + diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnWritePage3                            ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  return fnWritePage ( memFrame, 2 * DISK_PAGES + diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+// devices of priority test: one small device of priority 1, two devices of priority 0
+static void        countWrite                              ( int               dev )
+{
+  pthread_mutex_lock ( &g_Mtx );
+  // nothing is freed, high priority device is used until it has no room for a batch
+  assert ( dev == 0 || g_DevWrites[0] > 0 );
+  assert ( dev != 0 || ( g_DevWrites[1] == 0 && g_DevWrites[2] == 0 ) );
+  g_DevWrites[dev] ++;
+  pthread_mutex_unlock ( &g_Mtx );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnWritePageDev0                         ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  countWrite ( 0 );
+  return fnWritePage ( memFrame, diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnWritePageDev1                         ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  countWrite ( 1 );
+  return fnWritePage2 ( memFrame, diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnWritePageDev2                         ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  countWrite ( 2 );
+  return fnWritePage3 ( memFrame, diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+// slow device, write-back of victims overlaps faults of other processes
+bool               fnReadPageSlow                          ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  usleep ( 200 );
+  return fnReadPage ( memFrame, diskPage );
+}
+//-------------------------------------------------------------------------------------------------
+bool               fnWritePageSlow                         ( uint32_t          memFrame,
+                                                             uint32_t          diskPage )
+{
+  usleep ( 200 );
+  return fnWritePage ( memFrame, diskPage );
+}
+//-------------------------------------------------------------------------------------------------
 int                main                                    ( void )
 {
   g_Fp = fopen ( "/tmp/pagefile", "w+b" );
@@ -112,6 +408,45 @@ int                main                                    ( void )
   memMgr ( g_MemoryAligned, 100, DISK_PAGES, fnReadPage, fnWritePage, nullptr, seqTest2 );
   
   memMgr ( g_MemoryAligned, 100, DISK_PAGES, fnReadPage, fnWritePage, nullptr, parTest1 );
+
+  memMgr ( g_MemoryAligned, 100, DISK_PAGES, fnReadPage, fnWritePage, nullptr, lockTest1 );
+
+  memMgr ( g_MemoryAligned, 100, DISK_PAGES, fnReadPage, fnWritePagePin, nullptr, lockTest2 );
+
+  memMgr ( g_MemoryAligned, 100, DISK_PAGES, fnReadPage, fnWritePage, nullptr, lockLimitTest );
+
+  memMgr ( g_MemoryAligned, 128, DISK_PAGES, fnReadPage, fnWritePage, nullptr, compactionTest );
+
+  memMgr ( g_MemoryAligned, 64, DISK_PAGES, fnReadPage, fnWritePage, nullptr, compactionParTest );
+
+  memMgr ( g_MemoryAligned, 32, DISK_PAGES, fnReadPageSlow, fnWritePageSlow, nullptr, contentionTest );
+
+  // page directories and tables of processes take most of the frames
+  sem_init ( &g_ChurnSem, 0, 5 );
+  memMgr ( g_MemoryAligned, 16, DISK_PAGES, fnReadPage, fnWritePage, nullptr, churnTest );
+  sem_destroy ( &g_ChurnSem );
+
+  // small fast device first, then two striped devices
+  CSwapDevice swapDevices[] =
+  {
+    { 64,             1, fnReadPage,  fnWritePage  },
+    { DISK_PAGES / 2, 0, fnReadPage2, fnWritePage2 },
+    { DISK_PAGES / 2, 0, fnReadPage3, fnWritePage3 }
+  };
+  memMgr ( g_MemoryAligned, 100, swapDevices, 3, nullptr, parTest1 );
+
+  // device 0 is filled first, batches that do not fit are striped over devices 1 and 2
+  CSwapDevice priorityDevices[] =
+  {
+    { 16,             1, fnReadPage,  fnWritePageDev0 },
+    { DISK_PAGES / 2, 0, fnReadPage2, fnWritePageDev1 },
+    { DISK_PAGES / 2, 0, fnReadPage3, fnWritePageDev2 }
+  };
+  memMgr ( g_MemoryAligned, 100, priorityDevices, 3, nullptr, priorityTest );
+  assert ( g_DevWrites[0] > 0 && g_DevWrites[0] <= 16 );
+  assert ( g_DevWrites[1] > 0 && g_DevWrites[2] > 0 );
+  // one batch of reclaim is 100 / 8 pages
+  assert ( abs ( g_DevWrites[1] - g_DevWrites[2] ) <= 100 / 8 );
   
   pthread_mutex_destroy ( &g_Mtx );
   fclose ( g_Fp );
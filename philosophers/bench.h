@@ -0,0 +1,246 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+  Benchmark mode shared by philosophers programs:
+
+    philosophers -b [-n phils] [-t think_us] [-e eat_us] [-d seconds] [-s sample_us]
+
+  think and eat spin for given number of microseconds instead of sleeping.
+  After given number of seconds philosophers stop and meals per second,
+  percentiles of time spent in take_forks and Jain's fairness index of
+  meals are printed on one line, so programs can be compared side by side.
+  With -s the monitor takes a snapshot of states every sample_us meanwhile.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Wait times are counted in buckets of powers of two nanoseconds
+#define BENCH_BUCKETS 48
+
+/*
+  Written only by its philosopher. Monitor reads meals and wait_ns while it
+  runs, so they are updated atomically; hist and max_ns are read after it is joined.
+*/
+struct bench_phil {
+	long meals;
+	uint64_t wait_ns;
+	// Longest wait, bounds percentiles which fall into its bucket
+	uint64_t max_ns;
+	long hist[BENCH_BUCKETS];
+};
+
+int bench_mode;
+int bench_think_us;
+int bench_eat_us;
+int bench_seconds = 5;
+int bench_sample_us;
+int bench_stop;
+// Philosophers and bench_run meet here, waits are measured from bench_start_ns
+pthread_barrier_t bench_barrier;
+uint64_t bench_start_ns;
+struct bench_phil* bench_phils;
+// Takes snapshot of states for monitor, set by program
+void (*bench_sampler)(void);
+
+/*
+  Args:
+	phil_num - set by -n
+  Return value: 0 or -1 if arguments are wrong
+*/
+static int bench_parse(int argc, char* argv[], int* phil_num) {
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-b")) {
+			bench_mode = 1;
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			*phil_num = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			bench_think_us = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+			bench_eat_us = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			bench_seconds = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			bench_sample_us = atoi(argv[++i]);
+		} else {
+			break;
+		}
+	}
+	if (i < argc || *phil_num < 2 || bench_think_us < 0 || bench_eat_us < 0 || bench_seconds < 1 ||
+	    bench_sample_us < 0) {
+		fprintf(stderr, "Usage: %s [-b] [-n phils] [-t think_us] [-e eat_us] [-d seconds] [-s sample_us]\n", argv[0]);
+		return -1;
+	}
+	// Counters are kept in both modes, monitor prints them
+	bench_phils = calloc(*phil_num, sizeof(bench_phils[0]));
+	if (bench_mode) {
+		pthread_barrier_init(&bench_barrier, NULL, *phil_num + 1);
+	}
+	return 0;
+}
+
+static uint64_t bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_spin(int us) {
+	uint64_t end;
+
+	if (us == 0) {
+		return;
+	}
+	end = bench_now() + (uint64_t)us * 1000;
+	while (bench_now() < end)
+		;
+}
+
+// Philosophers keep going until benchmark ends
+static int bench_running(void) {
+	return !__atomic_load_n(&bench_stop, __ATOMIC_RELAXED);
+}
+
+// Philosopher waits until all philosophers are created and benchmark starts
+static void bench_wait_start(void) {
+	if (bench_mode) {
+		pthread_barrier_wait(&bench_barrier);
+	}
+}
+
+/*
+  Philosopher id got forks after waiting since start.
+  Waits which began before benchmark started or ended after it stopped
+  are not counted, so neither are their meals.
+*/
+static void bench_meal(int id, uint64_t start) {
+	struct bench_phil* b;
+	uint64_t wait_ns;
+	int bucket = 0;
+
+	if (start < bench_start_ns || !bench_running()) {
+		return;
+	}
+	wait_ns = bench_now() - start;
+	b = &bench_phils[id];
+	__atomic_store_n(&b->meals, b->meals + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->wait_ns, b->wait_ns + wait_ns, __ATOMIC_RELAXED);
+	while (bucket < BENCH_BUCKETS - 1 && (wait_ns >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	b->hist[bucket]++;
+	if (wait_ns > b->max_ns) {
+		b->max_ns = wait_ns;
+	}
+}
+
+/*
+  Upper bound of bucket holding percentile p of samples of hist, at most
+  max_ns, in microseconds
+*/
+static double bench_percentile(const long* hist, long samples, uint64_t max_ns, double p) {
+	long seen = 0;
+	int i;
+
+	for (i = 0; i < BENCH_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen > 0 && seen >= p * samples) {
+			break;
+		}
+	}
+	// Rest of samples is in the top bucket
+	if (((uint64_t)2 << i) > max_ns) {
+		return max_ns / 1000.0;
+	}
+	return (double)((uint64_t)2 << i) / 1000;
+}
+
+static void* bench_sample_thread(void* arg) {
+	long* samples = (long*)arg;
+
+	while (bench_running()) {
+		bench_sampler();
+		(*samples)++;
+		usleep(bench_sample_us);
+	}
+	return NULL;
+}
+
+/*
+  Let philosophers run for bench_seconds, stop and join them and print results.
+  Percentiles are of all waits and the range of 99th percentiles of single
+  philosophers. Only waits between start barrier and stop are counted.
+*/
+static void bench_run(const char* name, int phil_num, pthread_t* threads) {
+	long hist[BENCH_BUCKETS];
+	long meals = 0;
+	uint64_t max_ns = 0;
+	double sum_sq = 0;
+	double p99, p99_min = 0, p99_max = 0;
+	uint64_t stop;
+	double elapsed;
+	pthread_t sampler;
+	long samples = 0;
+	int i, j;
+
+	if (bench_sample_us > 0 && bench_sampler == NULL) {
+		fprintf(stderr, "%s: -s ignored, program takes no snapshots\n", name);
+	}
+	// Philosophers start waiting only after start is set
+	bench_start_ns = bench_now();
+	pthread_barrier_wait(&bench_barrier);
+	if (bench_sample_us > 0 && bench_sampler != NULL) {
+		pthread_create(&sampler, NULL, bench_sample_thread, &samples);
+	}
+	sleep(bench_seconds);
+	__atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+	stop = bench_now();
+	for (i = 0; i < phil_num; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (bench_sample_us > 0 && bench_sampler != NULL) {
+		pthread_join(sampler, NULL);
+	}
+	// Meals after stop are not counted
+	elapsed = (stop - bench_start_ns) / 1e9;
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < phil_num; i++) {
+		struct bench_phil* b = &bench_phils[i];
+		meals += b->meals;
+		sum_sq += (double)b->meals * b->meals;
+		for (j = 0; j < BENCH_BUCKETS; j++) {
+			hist[j] += b->hist[j];
+		}
+		if (b->max_ns > max_ns) {
+			max_ns = b->max_ns;
+		}
+		p99 = b->meals ? bench_percentile(b->hist, b->meals, b->max_ns, 0.99) : 0;
+		if (i == 0 || p99 < p99_min) {
+			p99_min = p99;
+		}
+		if (p99 > p99_max) {
+			p99_max = p99;
+		}
+	}
+	printf("%-12s phils %5d  %10.0f meals/s  wait us p50 %8.1f p99 %8.1f p99.9 %8.1f  phil p99 %.1f..%.1f  fairness %.3f",
+	       name, phil_num, meals / elapsed,
+	       bench_percentile(hist, meals, max_ns, 0.5), bench_percentile(hist, meals, max_ns, 0.99),
+	       bench_percentile(hist, meals, max_ns, 0.999), p99_min, p99_max,
+	       sum_sq ? (double)meals * meals / (phil_num * sum_sq) : 0.0);
+	if (bench_sample_us > 0 && bench_sampler != NULL) {
+		printf("  snapshots/s %.0f", samples / elapsed);
+	}
+	printf("\n");
+}
+
+#endif
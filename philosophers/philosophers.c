@@ -3,6 +3,8 @@
 #include <semaphore.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "bench.h"
+#include "seqlock.h"
 
 pthread_mutex_t mutex;
 
@@ -14,8 +16,11 @@ struct phil_data {
 	int state;
 	int id;
  	sem_t semaphor;
-} phils[10];
-	
+} *phils;
+
+int phil_num = PHILS;
+// States are changed with mutex locked, monitor reads them without it
+struct seqlock states_seq;
 
 int random_var(int min, int max) {
 	return (int)( min + 1.0 * rand () / RAND_MAX * ( max - min ));
@@ -23,19 +28,32 @@ int random_var(int min, int max) {
 }
 
 void think() {
-	sleep(random_var(1, 10));
+	if (bench_mode) {
+		bench_spin(bench_think_us);
+	} else {
+		sleep(random_var(1, 10));
+	}
 }
 
 void eat() {
-	sleep(random_var(1, 6));
+	if (bench_mode) {
+		bench_spin(bench_eat_us);
+	} else {
+		sleep(random_var(1, 6));
+	}
 }
 
 int left_neighbour(int id) {
-	return (id - 1) % PHILS;
+	return (id + phil_num - 1) % phil_num;
 }
 
 int right_neighbour(int id) {
-	return (id + 1) % PHILS;
+	return (id + 1) % phil_num;
+}
+
+// Called with mutex locked and states_seq write section open
+void set_state(int id, int state) {
+	__atomic_store_n(&phils[id].state, state, __ATOMIC_RELAXED);
 }
 
 void try_to_eat(int id) {
@@ -43,15 +61,17 @@ void try_to_eat(int id) {
 	    phils[left_neighbour(id)].state != EATING &&
 	    phils[right_neighbour(id)].state != EATING) {
 		// Got forks
-		phils[id].state = EATING;
+		set_state(id, EATING);
 		sem_post(&phils[id].semaphor);
 	}
 }
 
 void take_forks(int id) {
 	pthread_mutex_lock(&mutex);
-	phils[id].state = HUNGRY;
+	seq_write_begin(&states_seq);
+	set_state(id, HUNGRY);
 	try_to_eat(id);
+	seq_write_end(&states_seq);
 	pthread_mutex_unlock(&mutex);
 	sem_wait(&phils[id].semaphor);
 }
@@ -59,18 +79,25 @@ void take_forks(int id) {
 
 void put_forks(int id) {
 	pthread_mutex_lock(&mutex);
-	phils[id].state = THINKING;
+	seq_write_begin(&states_seq);
+	set_state(id, THINKING);
 	try_to_eat(left_neighbour(id));
 	try_to_eat(right_neighbour(id));
+	seq_write_end(&states_seq);
 	pthread_mutex_unlock(&mutex);
 }
 
 
 void* philosopher(void* arg) {
 	struct phil_data* phil_data = (struct phil_data*)arg;
-	while (1) {
+	uint64_t start;
+
+	bench_wait_start();
+	while (bench_running()) {
 		think();
+		start = bench_now();
 		take_forks(phil_data->id);
+		bench_meal(phil_data->id, start);
 		eat();
 		put_forks(phil_data->id);
 	}
@@ -86,37 +113,81 @@ char* state_str(int state) {
 	return "waiting";
 }
 
+int* snapshot;
+
+/*
+  Copy states of all philosophers to snapshot. Copy is consistent, as if it
+  was taken with mutex locked, but writers are not stalled by it.
+*/
+void take_snapshot(void) {
+	unsigned seq;
+	int retries = 0;
+	int i;
+
+	do {
+		if (retries++ == SEQ_RETRIES) {
+			// Writers keep changing states, wait for them
+			pthread_mutex_lock(&mutex);
+			for (i = 0; i < phil_num; i++) {
+				snapshot[i] = phils[i].state;
+			}
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+		seq = seq_read_begin(&states_seq);
+		for (i = 0; i < phil_num; i++) {
+			snapshot[i] = __atomic_load_n(&phils[i].state, __ATOMIC_RELAXED);
+		}
+	} while (seq_read_retry(&states_seq, seq));
+}
+
 void* print_thread(void* arg) {
 	int i;
-	
+
 	while(1) {
 		sleep(3);
+		take_snapshot();
 		printf("*****\n");
-		pthread_mutex_lock(&mutex);
-		for (i = 0; i < 10; i++) {
-			printf("phil %d : %s\n", phils[i].id,
-			       state_str(phils[i].state));
+		for (i = 0; i < phil_num; i++) {
+			printf("phil %d : %s, meals %ld, waited %.3f s\n", i,
+			       state_str(snapshot[i]),
+			       __atomic_load_n(&bench_phils[i].meals, __ATOMIC_RELAXED),
+			       __atomic_load_n(&bench_phils[i].wait_ns, __ATOMIC_RELAXED) / 1e9);
 		}
-		pthread_mutex_unlock(&mutex);
 	}
 }
 
-int main(void) {
+int main(int argc, char* argv[]) {
 	int i;
-	int rc;
 	pthread_t thread;
-	pthread_t threads[10];
+	pthread_t* threads;
 
-	pthread_create(&thread, NULL, print_thread, NULL);
-	for (i = 0; i < 10; i++) {
+	if (bench_parse(argc, argv, &phil_num) != 0) {
+		return 1;
+	}
+	phils = calloc(phil_num, sizeof(phils[0]));
+	snapshot = calloc(phil_num, sizeof(snapshot[0]));
+	bench_sampler = take_snapshot;
+	threads = calloc(phil_num, sizeof(threads[0]));
+	if (!bench_mode) {
+		pthread_create(&thread, NULL, print_thread, NULL);
+	}
+	for (i = 0; i < phil_num; i++) {
 		phils[i].state = THINKING;
 		phils[i].id = i;
 		sem_init(&phils[i].semaphor, 0, 0);
-		rc = pthread_create(&thread, NULL, philosopher, &phils[i]);
+	}
+	// Philosophers read states of neighbours, start them when all are set
+	for (i = 0; i < phil_num; i++) {
+		pthread_create(&thread, NULL, philosopher, &phils[i]);
 		threads[i] = thread;
 	}
 
-	for (int i = 0; i < 10; i++) {
+	if (bench_mode) {
+		bench_run("semaphore", phil_num, threads);
+		return 0;
+	}
+	for (int i = 0; i < phil_num; i++) {
 		pthread_join(threads[i], NULL);
 	}
 
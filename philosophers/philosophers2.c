@@ -3,6 +3,10 @@
 #include <semaphore.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "bench.h"
+#include "seqlock.h"
 
 pthread_mutex_t mutex;
 
@@ -13,30 +17,52 @@ pthread_mutex_t mutex;
 struct fork_data {
 	int state;
 	int phil_id;
-} forks[PHILS];
-
+} *forks;
+
+/*
+  Philosopher which can not get both forks parks on its own futex word.
+  put_forks hands both forks over to a parked neighbour as soon as they are
+  available, so only philosophers which can eat are woken and they do not
+  retake the mutex. Nothing is woken and no syscall is made if neighbours
+  are not parked.
+*/
 struct phil_data {
-	pthread_cond_t cond_var;
-} phils[PHILS];
+	// Protected by mutex
+	int parked;
+	// Futex word, set to 1 when forks are handed over
+	int granted;
+} *phils;
+
+int phil_num = PHILS;
+// Forks are changed with mutex locked, monitor reads them without it
+struct seqlock forks_seq;
 
 int random_var(int min, int max) {
 	return (int)( min + 1.0 * rand () / RAND_MAX * ( max - min ));
 }
 
 void think() {
-	sleep(random_var(1, 10));
+	if (bench_mode) {
+		bench_spin(bench_think_us);
+	} else {
+		sleep(random_var(1, 10));
+	}
 }
 
 void eat() {
-	sleep(random_var(1, 6));
+	if (bench_mode) {
+		bench_spin(bench_eat_us);
+	} else {
+		sleep(random_var(1, 6));
+	}
 }
 
 int left_fork(int id) {
-	return id % PHILS;
+	return id % phil_num;
 }
 
 int right_fork(int id) {
-	return (id + 1) % PHILS;
+	return (id + 1) % phil_num;
 }
 
 int both_forks_available(int id) {
@@ -48,33 +74,88 @@ int both_forks_available(int id) {
 	return 0;
 }
 
+// Called with mutex locked and forks_seq write section open
+void set_fork(int fork, int state, int id) {
+	__atomic_store_n(&forks[fork].state, state, __ATOMIC_RELAXED);
+	__atomic_store_n(&forks[fork].phil_id, id, __ATOMIC_RELAXED);
+}
+
+void use_forks(int id) {
+	set_fork(left_fork(id), USED, id);
+	set_fork(right_fork(id), USED, id);
+}
+
 void take_forks(int id) {
 	pthread_mutex_lock(&mutex);
-	while (!both_forks_available(id)) {
-		pthread_cond_wait(&phils[id].cond_var, &mutex);
+	if (both_forks_available(id)) {
+		seq_write_begin(&forks_seq);
+		use_forks(id);
+		seq_write_end(&forks_seq);
+		pthread_mutex_unlock(&mutex);
+		return;
 	}
-	forks[left_fork(id)].state = USED;
-	forks[right_fork(id)].state = USED;
-	forks[left_fork(id)].phil_id = id;
-	forks[right_fork(id)].phil_id = id;
+	phils[id].parked = 1;
+	__atomic_store_n(&phils[id].granted, 0, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&mutex);
+	while (!__atomic_load_n(&phils[id].granted, __ATOMIC_ACQUIRE)) {
+		// Returns at once if forks were handed over meanwhile
+		syscall(SYS_futex, &phils[id].granted, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+	}
+}
+
+/*
+  Called with mutex locked and forks_seq write section open.
+  Hand forks over to parked philosopher id if both are available.
+  Return value: 1 if id has to be woken
+*/
+int grant_forks(int id) {
+	if (!phils[id].parked || !both_forks_available(id)) {
+		return 0;
+	}
+	use_forks(id);
+	phils[id].parked = 0;
+	__atomic_store_n(&phils[id].granted, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void wake(int id) {
+	syscall(SYS_futex, &phils[id].granted, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 }
 
 void put_forks(int id) {
+	int left = (id + phil_num - 1) % phil_num;
+	int right = (id + 1) % phil_num;
+	int wake_left, wake_right;
+
 	pthread_mutex_lock(&mutex);
-	forks[left_fork(id)].state = AVAILABLE;
-	forks[right_fork(id)].state = AVAILABLE;
-	pthread_cond_signal(&phils[left_fork(id)].cond_var);
-	pthread_cond_signal(&phils[right_fork(id)].cond_var);
+	seq_write_begin(&forks_seq);
+	set_fork(left_fork(id), AVAILABLE, id);
+	set_fork(right_fork(id), AVAILABLE, id);
+	// Only neighbours sharing the forks can proceed now
+	wake_left = grant_forks(left);
+	wake_right = grant_forks(right);
+	seq_write_end(&forks_seq);
+	// Woken philosopher does not need mutex, wake it after section is closed
+	if (wake_left) {
+		wake(left);
+	}
+	if (wake_right) {
+		wake(right);
+	}
 	pthread_mutex_unlock(&mutex);
 }
 
 
 void* philosopher(void* arg) {
-	int id = (int)arg;
-	while (1) {
+	int id = (int)(long)arg;
+	uint64_t start;
+
+	bench_wait_start();
+	while (bench_running()) {
 		think();
+		start = bench_now();
 		take_forks(id);
+		bench_meal(id, start);
 		eat();
 		put_forks(id);
 	}
@@ -82,38 +163,84 @@ void* philosopher(void* arg) {
 	return NULL;
 }
 
+struct fork_data* snapshot;
+
+/*
+  Copy states of all forks to snapshot. Copy is consistent, as if it was
+  taken with mutex locked, but philosophers are not stalled by it.
+*/
+void take_snapshot(void) {
+	unsigned seq;
+	int retries = 0;
+	int i;
+
+	do {
+		if (retries++ == SEQ_RETRIES) {
+			// Forks keep changing, wait for philosophers
+			pthread_mutex_lock(&mutex);
+			memcpy(snapshot, forks, phil_num * sizeof(forks[0]));
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+		seq = seq_read_begin(&forks_seq);
+		for (i = 0; i < phil_num; i++) {
+			snapshot[i].state = __atomic_load_n(&forks[i].state, __ATOMIC_RELAXED);
+			snapshot[i].phil_id = __atomic_load_n(&forks[i].phil_id, __ATOMIC_RELAXED);
+		}
+	} while (seq_read_retry(&forks_seq, seq));
+}
+
 void* print_thread(void* arg) {
 	int i;
-	
+
 	while(1) {
 		sleep(3);
+		take_snapshot();
 		printf("*****\n");
-		pthread_mutex_lock(&mutex);
-		for (i = 0; i < PHILS; i++) {
-			if (forks[i].state == USED &&
-			    forks[i].phil_id == i) {
+		for (i = 0; i < phil_num; i++) {
+			if (snapshot[i].state == USED &&
+			    snapshot[i].phil_id == i) {
 				printf("fork state %d eating\n", i);
 			}
 		}
-		pthread_mutex_unlock(&mutex);
+		for (i = 0; i < phil_num; i++) {
+			printf("phil %d : meals %ld, waited %.3f s\n", i,
+			       __atomic_load_n(&bench_phils[i].meals, __ATOMIC_RELAXED),
+			       __atomic_load_n(&bench_phils[i].wait_ns, __ATOMIC_RELAXED) / 1e9);
+		}
 	}
 }
 
 
-int main(void) {
+int main(int argc, char* argv[]) {
 	int i;
 	pthread_t thread;
-	pthread_t threads[PHILS];
+	pthread_t* threads;
 
-	pthread_create(&thread, NULL, print_thread, NULL);
-	for (i = 0; i < PHILS; i++) {
+	if (bench_parse(argc, argv, &phil_num) != 0) {
+		return 1;
+	}
+	forks = calloc(phil_num, sizeof(forks[0]));
+	phils = calloc(phil_num, sizeof(phils[0]));
+	snapshot = calloc(phil_num, sizeof(snapshot[0]));
+	bench_sampler = take_snapshot;
+	threads = calloc(phil_num, sizeof(threads[0]));
+	if (!bench_mode) {
+		pthread_create(&thread, NULL, print_thread, NULL);
+	}
+	for (i = 0; i < phil_num; i++) {
 		forks[i].state = AVAILABLE;
-		pthread_cond_init(&phils[i].cond_var, NULL);
-		pthread_create(&thread, NULL, philosopher, (void*)i);
+	}
+	for (i = 0; i < phil_num; i++) {
+		pthread_create(&thread, NULL, philosopher, (void*)(long)i);
 		threads[i] = thread;
 	}
 
-	for (i = 0; i < PHILS; i++) {
+	if (bench_mode) {
+		bench_run("futex", phil_num, threads);
+		return 0;
+	}
+	for (i = 0; i < phil_num; i++) {
 		pthread_join(threads[i], NULL);
 	}
 
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "seqlock.h"
+
+/*
+  Chandy-Misra solution: there is no global lock, each fork has its own mutex.
+  Fork is owned by one of its two philosophers and is either clean or dirty.
+  Fork gets dirty when its owner eats. Hungry philosopher keeps clean forks
+  and gives dirty forks to neighbours which request them, so each neighbour
+  gets to eat before the philosopher eats again.
+  Initially forks are dirty and owned by the lower numbered philosopher,
+  which makes the precedence graph acyclic and the solution deadlock free.
+*/
+
+#define PHILS 10
+
+#define THINKING 0
+#define HUNGRY 1
+#define EATING 2
+
+struct fork_data {
+	pthread_mutex_t mutex;
+	// Signalled when fork is handed over
+	pthread_cond_t cond_var;
+	int owner;
+	int dirty;
+	// Owner eats
+	int in_use;
+	// The other philosopher waits for the fork
+	int requested;
+} *forks;
+
+struct phil_data {
+	int state;
+	int id;
+	// Philosopher is the only writer of its state, so writers need no lock
+	struct seqlock seq;
+} *phils;
+
+int phil_num = PHILS;
+
+int random_var(int min, int max) {
+	return (int)( min + 1.0 * rand () / RAND_MAX * ( max - min ));
+}
+
+void think() {
+	if (bench_mode) {
+		bench_spin(bench_think_us);
+	} else {
+		sleep(random_var(1, 10));
+	}
+}
+
+void eat() {
+	if (bench_mode) {
+		bench_spin(bench_eat_us);
+	} else {
+		sleep(random_var(1, 6));
+	}
+}
+
+int left_fork(int id) {
+	return id;
+}
+
+int right_fork(int id) {
+	return (id + 1) % phil_num;
+}
+
+// The other philosopher sharing fork
+int other_phil(int fork, int id) {
+	return (fork == id) ? (fork + phil_num - 1) % phil_num : fork;
+}
+
+void set_state(int id, int state) {
+	seq_write_begin(&phils[id].seq);
+	__atomic_store_n(&phils[id].state, state, __ATOMIC_RELAXED);
+	seq_write_end(&phils[id].seq);
+}
+
+/*
+  Called with fork mutex locked.
+  Try to get fork for philosopher id.
+  Return value: 1 if id owns fork
+*/
+int acquire_fork(int fork, int id) {
+	struct fork_data* f = &forks[fork];
+
+	if (f->owner == id) {
+		if (f->dirty && f->requested) {
+			// Neighbour waits, let it eat first
+			f->owner = other_phil(fork, id);
+			f->dirty = 0;
+			f->requested = 0;
+			pthread_cond_broadcast(&f->cond_var);
+		} else {
+			return 1;
+		}
+	} else if (f->dirty && !f->in_use) {
+		// Owner does not need it, take it
+		f->owner = id;
+		f->dirty = 0;
+		f->requested = 0;
+		return 1;
+	}
+	f->requested = 1;
+	return 0;
+}
+
+void take_forks(int id) {
+	// Forks are locked in increasing order
+	int first = left_fork(id) < right_fork(id) ? left_fork(id) : right_fork(id);
+	int second = left_fork(id) < right_fork(id) ? right_fork(id) : left_fork(id);
+	int missing;
+
+	set_state(id, HUNGRY);
+	while (1) {
+		pthread_mutex_lock(&forks[first].mutex);
+		pthread_mutex_lock(&forks[second].mutex);
+		int got_first = acquire_fork(first, id);
+		int got_second = acquire_fork(second, id);
+		if (got_first && got_second) {
+			forks[first].in_use = 1;
+			forks[second].in_use = 1;
+			set_state(id, EATING);
+			pthread_mutex_unlock(&forks[second].mutex);
+			pthread_mutex_unlock(&forks[first].mutex);
+			return;
+		}
+		// Wait for one missing fork, the other one is rechecked afterwards
+		missing = got_first ? second : first;
+		pthread_mutex_unlock(&forks[missing == first ? second : first].mutex);
+		while (forks[missing].owner != id) {
+			pthread_cond_wait(&forks[missing].cond_var, &forks[missing].mutex);
+		}
+		pthread_mutex_unlock(&forks[missing].mutex);
+	}
+}
+
+// Forks get dirty, requested ones are handed over right away
+void release_fork(int fork, int id) {
+	struct fork_data* f = &forks[fork];
+
+	pthread_mutex_lock(&f->mutex);
+	f->in_use = 0;
+	f->dirty = 1;
+	if (f->requested) {
+		f->owner = other_phil(fork, id);
+		f->dirty = 0;
+		f->requested = 0;
+		pthread_cond_broadcast(&f->cond_var);
+	}
+	pthread_mutex_unlock(&f->mutex);
+}
+
+void put_forks(int id) {
+	set_state(id, THINKING);
+	release_fork(left_fork(id), id);
+	release_fork(right_fork(id), id);
+}
+
+void* philosopher(void* arg) {
+	struct phil_data* phil_data = (struct phil_data*)arg;
+	uint64_t start;
+
+	bench_wait_start();
+	while (bench_running()) {
+		think();
+		start = bench_now();
+		take_forks(phil_data->id);
+		bench_meal(phil_data->id, start);
+		eat();
+		put_forks(phil_data->id);
+	}
+
+	return NULL;
+}
+
+char* state_str(int state) {
+	if (state == THINKING)
+		return "thinking";
+	if (state == EATING)
+		return "eating";
+	return "waiting";
+}
+
+int* snapshot;
+unsigned* snapshot_seq;
+
+/*
+  Copy states of all philosophers to snapshot. Sequences of all philosophers
+  are read before their states and checked after all states are copied, so if
+  none changed, all states held at one moment. There is no global lock to fall
+  back to, after SEQ_RETRIES attempts the last copy is kept: each state of it
+  is valid, but they need not hold at one moment.
+*/
+void take_snapshot(void) {
+	int retries = 0;
+	int changed;
+	int i;
+
+	do {
+		for (i = 0; i < phil_num; i++) {
+			snapshot_seq[i] = seq_read_begin(&phils[i].seq);
+			snapshot[i] = __atomic_load_n(&phils[i].state, __ATOMIC_RELAXED);
+		}
+		changed = 0;
+		for (i = 0; i < phil_num && !changed; i++) {
+			changed = seq_read_retry(&phils[i].seq, snapshot_seq[i]);
+		}
+	} while (changed && ++retries < SEQ_RETRIES);
+}
+
+void* print_thread(void* arg) {
+	int i;
+
+	while(1) {
+		sleep(3);
+		take_snapshot();
+		printf("*****\n");
+		for (i = 0; i < phil_num; i++) {
+			printf("phil %d : %s, meals %ld, waited %.3f s\n", phils[i].id,
+			       state_str(snapshot[i]),
+			       __atomic_load_n(&bench_phils[i].meals, __ATOMIC_RELAXED),
+			       __atomic_load_n(&bench_phils[i].wait_ns, __ATOMIC_RELAXED) / 1e9);
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int i;
+	pthread_t thread;
+	pthread_t* threads;
+
+	if (bench_parse(argc, argv, &phil_num) != 0) {
+		return 1;
+	}
+	forks = calloc(phil_num, sizeof(forks[0]));
+	phils = calloc(phil_num, sizeof(phils[0]));
+	threads = calloc(phil_num, sizeof(threads[0]));
+	snapshot = calloc(phil_num, sizeof(snapshot[0]));
+	snapshot_seq = calloc(phil_num, sizeof(snapshot_seq[0]));
+	bench_sampler = take_snapshot;
+	for (i = 0; i < phil_num; i++) {
+		pthread_mutex_init(&forks[i].mutex, NULL);
+		pthread_cond_init(&forks[i].cond_var, NULL);
+		// Fork i is shared by philosophers i - 1 and i, lower one gets it
+		forks[i].owner = (i > 0) ? i - 1 : 0;
+		forks[i].dirty = 1;
+		phils[i].state = THINKING;
+		phils[i].id = i;
+	}
+
+	if (!bench_mode) {
+		pthread_create(&thread, NULL, print_thread, NULL);
+	}
+	for (i = 0; i < phil_num; i++) {
+		pthread_create(&threads[i], NULL, philosopher, &phils[i]);
+	}
+
+	if (bench_mode) {
+		bench_run("chandy-misra", phil_num, threads);
+		return 0;
+	}
+
+	for (i = 0; i < phil_num; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return 0;
+}
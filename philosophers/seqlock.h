@@ -0,0 +1,39 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+/*
+  Sequence lock: writers, serialized by some other lock, make the sequence
+  odd while they change protected data. Readers take no lock, they copy the
+  data and retry if the sequence was odd or changed meanwhile.
+  Protected data are accessed with relaxed atomics, so that racing copies
+  are not undefined behaviour.
+*/
+
+// Reader gives up and takes writers' lock after this many retries
+#define SEQ_RETRIES 16
+
+struct seqlock {
+	unsigned seq;
+};
+
+static void seq_write_begin(struct seqlock* s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(struct seqlock* s) {
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Return value: sequence to pass to seq_read_retry, odd if writer is active
+static unsigned seq_read_begin(struct seqlock* s) {
+	return __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+}
+
+// Return value: 1 if data read since seq_read_begin may be inconsistent
+static int seq_read_retry(struct seqlock* s, unsigned seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (seq & 1) || __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif
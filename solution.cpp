@@ -16,13 +16,22 @@ struct pte {
 	uint32_t bitW : 1;
 	uint32_t bitU : 1;
 	uint32_t swaped : 1; // Normally unused 
-	uint32_t unused2 : 1;
+	uint32_t inFlight : 1; // Page is being read from or written to swap
 	uint32_t bitR : 1;
 	uint32_t bitD : 1;
-	uint32_t unused3 : 5;
+	uint32_t locked : 5; // Number of lock() calls covering page, page is never selected for swapping out while nonzero
 	uint32_t frameNumber : 20;
 };
 
+// Max number of lock() calls covering one page, width of pte locked field
+const uint32_t PIN_MAX = 31;
+// Max number of pages swapped out by one reclaim pass
+const uint32_t RECLAIM_BATCH = 32;
+// Orders of blocks of frames, block of order k has 1 << k frames
+const uint32_t FRAME_ORDERS = 21;
+// Order of frame which is not first frame of free block
+const uint8_t FRAME_NOT_FREE = 0xff;
+
 union addr {
 	struct {
 		uint32_t pageShift : 12;
@@ -33,294 +42,1243 @@ union addr {
 };
 
 
+/*
+  Buddy system over frames of main memory. Block of order k is 1 << k frames
+  aligned to its size. Free blocks are kept in doubly linked list per order,
+  links and order of free block are stored in arrays indexed by frame.
+  Caller serializes access.
+*/
+class FrameBuddy {
+public:
+	static uint32_t metadataSize(uint32_t pageNum);
+	void init(uint8_t* meta, uint32_t first, uint32_t pageNum);
+	uint32_t allocate(uint32_t order);
+	void free(uint32_t frame, uint32_t order);
+	void remove(uint32_t frame, uint32_t order);
+	// Order of free block starting at frame or FRAME_NOT_FREE
+	uint8_t freeOrder(uint32_t frame) { return m_Order[frame]; }
+	uint32_t freeFrames() { return m_FreeNum; }
+	void print();
+private:
+	void push(uint32_t frame, uint32_t order);
+	uint32_t* m_Next;
+	uint32_t* m_Prev;
+	uint8_t* m_Order;
+	uint32_t m_Head[FRAME_ORDERS];
+	// Bit k is set if list of order k is not empty
+	uint32_t m_NonEmpty;
+	uint32_t m_PageNum;
+	uint32_t m_FreeNum;
+};
+
+// Bytes of arrays of links and orders for pageNum frames
+uint32_t FrameBuddy::metadataSize(uint32_t pageNum) {
+	return pageNum * (2 * sizeof(uint32_t) + sizeof(uint8_t));
+}
+
+/* Args:
+	meta - memory for arrays, metadataSize(pageNum) bytes
+	first - first frame managed by buddy system, frames below are reserved
+	pageNum - number of frames
+   Frames are covered by the largest blocks aligned to their size
+*/
+void FrameBuddy::init(uint8_t* meta, uint32_t first, uint32_t pageNum) {
+	m_Next = (uint32_t*)meta;
+	m_Prev = m_Next + pageNum;
+	m_Order = (uint8_t*)(m_Prev + pageNum);
+	m_PageNum = pageNum;
+	m_FreeNum = 0;
+	m_NonEmpty = 0;
+	memset(m_Order, FRAME_NOT_FREE, pageNum);
+	for (uint32_t k = 0; k < FRAME_ORDERS; k++) {
+		m_Head[k] = UINT32_MAX;
+	}
+	uint32_t frame = first;
+	while (frame < pageNum) {
+		uint32_t order = 31 - __builtin_clz(pageNum - frame);
+		if (frame != 0 && (uint32_t)__builtin_ctz(frame) < order) {
+			order = __builtin_ctz(frame);
+		}
+		if (order >= FRAME_ORDERS) {
+			order = FRAME_ORDERS - 1;
+		}
+		push(frame, order);
+		frame += 1U << order;
+	}
+}
+
+void FrameBuddy::push(uint32_t frame, uint32_t order) {
+	m_Prev[frame] = UINT32_MAX;
+	m_Next[frame] = m_Head[order];
+	if (m_Head[order] != UINT32_MAX) {
+		m_Prev[m_Head[order]] = frame;
+	}
+	m_Head[order] = frame;
+	m_Order[frame] = order;
+	m_NonEmpty |= 1U << order;
+	m_FreeNum += 1U << order;
+}
+
+// Take free block out of list of its order
+void FrameBuddy::remove(uint32_t frame, uint32_t order) {
+	if (m_Prev[frame] != UINT32_MAX) {
+		m_Next[m_Prev[frame]] = m_Next[frame];
+	} else {
+		m_Head[order] = m_Next[frame];
+		if (m_Head[order] == UINT32_MAX) {
+			m_NonEmpty &= ~(1U << order);
+		}
+	}
+	if (m_Next[frame] != UINT32_MAX) {
+		m_Prev[m_Next[frame]] = m_Prev[frame];
+	}
+	m_Order[frame] = FRAME_NOT_FREE;
+	m_FreeNum -= 1U << order;
+}
+
+/* Take block from the smallest non-empty list of order or higher and split it.
+   Return value: first frame of block or UINT32_MAX
+*/
+uint32_t FrameBuddy::allocate(uint32_t order) {
+	if (order >= FRAME_ORDERS) {
+		return UINT32_MAX;
+	}
+	uint32_t orders = m_NonEmpty & (~0U << order);
+	if (orders == 0) {
+		return UINT32_MAX;
+	}
+	uint32_t k = __builtin_ctz(orders);
+	uint32_t frame = m_Head[k];
+	remove(frame, k);
+	while (k > order) {
+		k--;
+		push(frame + (1U << k), k);
+	}
+	return frame;
+}
+
+// Return block to free lists, merge it with its buddy while the buddy is free
+void FrameBuddy::free(uint32_t frame, uint32_t order) {
+	while (order < FRAME_ORDERS - 1) {
+		uint32_t buddy = frame ^ (1U << order);
+		if (buddy >= m_PageNum || m_Order[buddy] != order) {
+			break;
+		}
+		remove(buddy, order);
+		frame &= ~(1U << order);
+		order++;
+	}
+	push(frame, order);
+}
+
+void FrameBuddy::print() {
+	for (uint32_t k = 0; k < FRAME_ORDERS; k++) {
+		if (m_Head[k] == UINT32_MAX) {
+			continue;
+		}
+		cout << "order " << k << ":";
+		for (uint32_t frame = m_Head[k]; frame != UINT32_MAX; frame = m_Next[frame]) {
+			cout << " " << frame;
+		}
+		cout << "\n";
+	}
+}
+
 /*
   Class to allocate and free pages of main memory with help of swap space.
 */
 class FreeSpaceManager {
 public:
-	FreeSpaceManager(uint8_t* mem, uint32_t pageNum, uint32_t swapPageNum,
-		             bool  (*readPage) (uint32_t memFrame, uint32_t diskPage),
-		             bool  (*writePage) (uint32_t memFrame, uint32_t diskPage));
-	bool readPage(uint32_t memFrame, uint32_t diskPage);
+	FreeSpaceManager(uint8_t* mem, uint32_t pageNum,
+		             const CSwapDevice* swapDevices, uint32_t swapDeviceCount);
+	bool readPage(uint32_t memFrame, uint32_t swapPageNum);
+	bool writePage(uint32_t memFrame, uint32_t swapPageNum);
 	uint32_t allocateSwapPage(void);
 	void freeSwapPage(uint32_t pageNum);
 	uint32_t allocatePage(bool isForPageDir);
+	uint32_t allocatePages(uint32_t n, uint32_t* pages);
 	void freePage(uint32_t pageNum);
+	void freePages(uint32_t n, const uint32_t* pages);
+	uint32_t allocateFrames(uint32_t order);
+	void freeFrames(uint32_t frame, uint32_t order);
 	uint32_t nrPages() { return m_PageNum; }
-	void savePageDir(uint32_t pageNum);
-	void freePageDirs(uint32_t pageNum);
+	int savePageDir(uint32_t pageNum);
+	int findPageDir(uint32_t pageNum);
+	void freePageDirs(int slot);
+	void lockPageDir(int slot) { pthread_mutex_lock(&m_PageDirMtx[slot]); }
+	void unlockPageDir(int slot) { pthread_mutex_unlock(&m_PageDirMtx[slot]); }
+	void waitPageDir(int slot) { pthread_cond_wait(&m_PageDirCond[slot], &m_PageDirMtx[slot]); }
+	void wakePageDir(int slot) { pthread_cond_broadcast(&m_PageDirCond[slot]); }
+	void inFlightBegin(uint32_t n);
+	void inFlightEnd(uint32_t n);
+	bool reservePins(uint32_t n);
+	void releasePins(uint32_t n);
+	// Counters of pages of address space, called with address space locked
+	void countPages(int slot, int resident, int swapped) { m_Resident[slot] += resident; m_Swapped[slot] += swapped; }
+	uint32_t residentPages(int slot) { return m_Resident[slot]; }
+	uint32_t swappedPages(int slot) { return m_Swapped[slot]; }
 	void printFreeList();
+	~FreeSpaceManager();
 private:
-	uint32_t m_MemFreeListHead;
-	uint32_t m_SwapFreeListHead;
-	uint32_t* m_MemFreeList;
-	uint32_t* m_SwapFreeList;
+	uint32_t reclaimPages(void);
+	uint32_t scanVictims(struct pte** victims, int* victimSlots, uint32_t* frames);
+	uint32_t movablePages(uint32_t slot, uint32_t first, uint32_t size, struct pte** ptes);
+	uint32_t compactFrames(uint32_t order);
+	void allocateSwapPages(uint32_t n, uint32_t* pages);
+	uint32_t allocateSwapRun(uint32_t n);
+	uint32_t findSwapRun(uint32_t dev, uint32_t n);
+	void markSwapRun(uint32_t dev, uint32_t first, uint32_t n);
+	uint32_t findSwapDevice(uint32_t swapPageNum);
+	// Protects m_Frames and swap bitmap
+	pthread_mutex_t m_Mtx;
+	// Serializes victim scans
+	pthread_mutex_t m_ReclaimMtx;
+	/*
+	  Pages being written to or read from swap, they become free or evictable
+	  when done. m_InFlightGen counts finished transfers. Leaf lock.
+	*/
+	pthread_mutex_t m_InFlightMtx;
+	pthread_cond_t m_InFlightCond;
+	uint32_t m_InFlight;
+	uint32_t m_InFlightGen;
+	// Frames of locked pages, including pins reserved by lock in progress. Protected by m_Mtx
+	uint32_t m_Pinned;
+	uint32_t m_PinMax;
+	// Protects m_PageDirUsed
+	pthread_mutex_t m_PageDirUsedMtx;
+	// Per address space lock. Protects m_PageDirs[i] and page tables reachable from it
+	pthread_mutex_t m_PageDirMtx[PROCESS_MAX];
+	// Signalled when inFlight bit of some pte of the address space is cleared
+	pthread_cond_t m_PageDirCond[PROCESS_MAX];
+	bool m_PageDirUsed[PROCESS_MAX];
+	// Number of pages reclaimed by one pass, at most RECLAIM_BATCH
+	uint32_t m_ReclaimBatch;
+	// Position where next reclaim pass starts: slot of m_PageDirs and page directory index
+	uint32_t m_ReclaimSlot;
+	uint32_t m_ReclaimPde;
+	uint8_t* m_Mem;
+	FrameBuddy m_Frames;
+	// Bit per swap page, 1 means used. Bits past m_SwapPageNum are set
+	uint64_t* m_SwapBitmap;
+	uint32_t m_SwapBitmapWords;
 	uint32_t m_PageNum;
 	uint32_t m_SwapPageNum;
 	uint32_t m_PageDirs[PROCESS_MAX];
-	bool  (*m_readPage) (uint32_t memFrame, uint32_t diskPage);
-	bool  (*m_writePage) (uint32_t memFrame, uint32_t diskPage);
+	// Pages of address space in memory and in swap, protected by its lock
+	uint32_t m_Resident[PROCESS_MAX];
+	uint32_t m_Swapped[PROCESS_MAX];
+	/*
+	  Swap devices sorted by priority, highest first. Swap page numbers of device
+	  are first .. first + pages - 1, device itself is addressed from 0
+	*/
+	struct swapDevice {
+		uint32_t first;
+		uint32_t pages;
+		int priority;
+		// Swap page where next search for free run starts
+		uint32_t rover;
+		bool  (*readPage) (uint32_t memFrame, uint32_t diskPage);
+		bool  (*writePage) (uint32_t memFrame, uint32_t diskPage);
+	} m_SwapDevs[SWAP_DEVICE_MAX];
+	uint32_t m_SwapDevNum;
+	// Indexed by first device of group of equal priority: device of group to try next
+	uint32_t m_SwapStripe[SWAP_DEVICE_MAX];
 };
 
 /* Constructor
    Args:
         mem - pointer to memory
 	pageNum - number of frames(pages) in main memory.
-	swapPageNum - number of frames in swap space
-	readPage - function to read page from swap space
-	writePage - function to write page into swap space
-   Initialize free lists for main memory pages and for swap space.
-   Implement free list as arrays stored in the beginning of  main memory
+	swapDevices - swap devices, each with its size, priority and read/write functions
+	swapDeviceCount - number of swap devices
+   Initialize buddy system of main memory frames and bitmap for swap space.
+   Swap pages of all devices share one bitmap.
+   Both are stored in the beginning of main memory
 */
-FreeSpaceManager::FreeSpaceManager(uint8_t* mem, uint32_t pageNum, uint32_t swapPageNum,
-				   bool  (*readPage) (uint32_t memFrame, uint32_t diskPage),
-				   bool  (*writePage) (uint32_t memFrame, uint32_t diskPage)) {
+FreeSpaceManager::FreeSpaceManager(uint8_t* mem, uint32_t pageNum,
+				   const CSwapDevice* swapDevices, uint32_t swapDeviceCount) {
+	assert(swapDeviceCount <= SWAP_DEVICE_MAX);
 	m_PageNum = pageNum;
-	m_SwapPageNum = swapPageNum;
-	// Number of pages needed for free lists
-	int pages = ((pageNum + swapPageNum) * sizeof(uint32_t) + (CCPU::PAGE_SIZE - 1)) / CCPU::PAGE_SIZE;
-	m_MemFreeList = (uint32_t*)mem;
-	m_MemFreeListHead = pages;
-	for (unsigned i = m_MemFreeListHead; i < pageNum; i++) {
-		if (i == pageNum - 1) {
-			// End of free list
-			m_MemFreeList[i] = UINT32_MAX;
-		}
-		else {
-			m_MemFreeList[i] = i + 1;
+	m_SwapDevNum = swapDeviceCount;
+	// Insertion sort by priority, stable so that equal priority devices keep their order
+	for (uint32_t i = 0; i < swapDeviceCount; i++) {
+		uint32_t k = i;
+		while (k > 0 && m_SwapDevs[k - 1].priority < swapDevices[i].m_Priority) {
+			m_SwapDevs[k] = m_SwapDevs[k - 1];
+			k--;
 		}
+		m_SwapDevs[k].pages = swapDevices[i].m_Pages;
+		m_SwapDevs[k].priority = swapDevices[i].m_Priority;
+		m_SwapDevs[k].readPage = swapDevices[i].m_ReadPage;
+		m_SwapDevs[k].writePage = swapDevices[i].m_WritePage;
 	}
-	m_SwapFreeList = m_MemFreeList + pageNum;
-	m_SwapFreeListHead = 0;
-	for (unsigned i = m_SwapFreeListHead; i < swapPageNum; i++) {
-		if (i == swapPageNum - 1) {
-			// End of free list
-			m_SwapFreeList[i] = UINT32_MAX;
-		}
-		else {
-			m_SwapFreeList[i] = i + 1;
-		}
+	uint32_t swapPageNum = 0;
+	for (uint32_t i = 0; i < swapDeviceCount; i++) {
+		m_SwapDevs[i].first = swapPageNum;
+		m_SwapDevs[i].rover = swapPageNum;
+		m_SwapStripe[i] = 0;
+		swapPageNum += m_SwapDevs[i].pages;
+	}
+	// Swap page number has to fit into pte frameNumber
+	assert(swapPageNum <= (1U << 20));
+	m_SwapPageNum = swapPageNum;
+	// Swap bitmap follows arrays of frame buddy system, aligned to its word size
+	uint32_t bitmapOffset = (FrameBuddy::metadataSize(pageNum) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	m_SwapBitmapWords = (swapPageNum + 63) / 64;
+	// Number of pages needed for buddy system and bitmap
+	int pages = (bitmapOffset + m_SwapBitmapWords * sizeof(uint64_t) + (CCPU::PAGE_SIZE - 1)) / CCPU::PAGE_SIZE;
+	m_Mem = mem;
+	m_Frames.init(mem, pages, pageNum);
+	m_SwapBitmap = (uint64_t*)(mem + bitmapOffset);
+	for (unsigned i = 0; i < m_SwapBitmapWords; i++) {
+		m_SwapBitmap[i] = 0;
+	}
+	if (swapPageNum % 64 != 0) {
+		// Mark nonexistent swap pages of last word as used
+		m_SwapBitmap[m_SwapBitmapWords - 1] = ~0ULL << (swapPageNum % 64);
 	}
 
-	m_readPage = readPage;
-	m_writePage = writePage;
+	// Do not evict too big part of small memory at once
+	m_ReclaimBatch = pageNum / 8;
+	if (m_ReclaimBatch > RECLAIM_BATCH) {
+		m_ReclaimBatch = RECLAIM_BATCH;
+	}
+	if (m_ReclaimBatch == 0) {
+		m_ReclaimBatch = 1;
+	}
+	m_ReclaimSlot = 0;
+	m_ReclaimPde = 0;
 
 	// Array of numbers of  page directories 
 	for (unsigned i = 0; i < PROCESS_MAX; i++) {
 		m_PageDirs[i] = 0;
+		m_PageDirUsed[i] = false;
+		pthread_mutex_init(&m_PageDirMtx[i], nullptr);
+		pthread_cond_init(&m_PageDirCond[i], nullptr);
 	}
+	pthread_mutex_init(&m_Mtx, nullptr);
+	pthread_mutex_init(&m_ReclaimMtx, nullptr);
+	pthread_mutex_init(&m_InFlightMtx, nullptr);
+	pthread_cond_init(&m_InFlightCond, nullptr);
+	m_InFlight = 0;
+	m_InFlightGen = 0;
+	// Half of frames is never pinned, page tables and faulting processes use it
+	m_Pinned = 0;
+	m_PinMax = m_Frames.freeFrames() / 2;
+	pthread_mutex_init(&m_PageDirUsedMtx, nullptr);
 }
 
-bool FreeSpaceManager::readPage(uint32_t memFrame, uint32_t diskPage) {
-	return m_readPage(memFrame, diskPage);
+FreeSpaceManager::~FreeSpaceManager() {
+	for (unsigned i = 0; i < PROCESS_MAX; i++) {
+		pthread_mutex_destroy(&m_PageDirMtx[i]);
+		pthread_cond_destroy(&m_PageDirCond[i]);
+	}
+	pthread_mutex_destroy(&m_Mtx);
+	pthread_mutex_destroy(&m_ReclaimMtx);
+	pthread_mutex_destroy(&m_InFlightMtx);
+	pthread_cond_destroy(&m_InFlightCond);
+	pthread_mutex_destroy(&m_PageDirUsedMtx);
 }
 
-// Take free page from swap list head. Update list head with next element
-uint32_t FreeSpaceManager::allocateSwapPage(void) {
-	uint32_t pageNum = this->m_SwapFreeListHead;
-	if (pageNum == UINT32_MAX) {
-		return pageNum;
+// Return index of swap device holding swapPageNum
+uint32_t FreeSpaceManager::findSwapDevice(uint32_t swapPageNum) {
+	uint32_t dev = 0;
+	while (swapPageNum >= m_SwapDevs[dev].first + m_SwapDevs[dev].pages) {
+		dev++;
+	}
+	return dev;
+}
+
+bool FreeSpaceManager::readPage(uint32_t memFrame, uint32_t swapPageNum) {
+	struct swapDevice& dev = m_SwapDevs[findSwapDevice(swapPageNum)];
+	return dev.readPage(memFrame, swapPageNum - dev.first);
+}
+
+bool FreeSpaceManager::writePage(uint32_t memFrame, uint32_t swapPageNum) {
+	struct swapDevice& dev = m_SwapDevs[findSwapDevice(swapPageNum)];
+	return dev.writePage(memFrame, swapPageNum - dev.first);
+}
+
+/*
+   Find n consecutive free swap pages of device dev. Search starts at device rover
+   and wraps around, whole used words are skipped, free and used bit runs inside
+   word are measured with count trailing zeros.
+   Called with m_Mtx locked.
+   Return value: first swap page of run or UINT32_MAX if there is no such run
+*/
+uint32_t FreeSpaceManager::findSwapRun(uint32_t dev, uint32_t n) {
+	uint32_t end = m_SwapDevs[dev].first + m_SwapDevs[dev].pages;
+	if (m_SwapDevs[dev].pages == 0) {
+		return UINT32_MAX;
+	}
+	// Pass 0 searches from rover to the end, pass 1 from the beginning
+	for (int pass = 0; pass < 2; pass++) {
+		uint32_t firstBit = (pass == 0) ? m_SwapDevs[dev].rover : m_SwapDevs[dev].first;
+		uint32_t run = 0;
+		uint32_t start = 0;
+		for (uint32_t w = firstBit / 64; w <= (end - 1) / 64; w++) {
+			uint64_t word = m_SwapBitmap[w];
+			if (w == firstBit / 64 && firstBit % 64 != 0) {
+				// Bits below rover are not part of this pass
+				word |= (1ULL << (firstBit % 64)) - 1;
+			}
+			if (w == (end - 1) / 64 && end % 64 != 0) {
+				// Bits of next device
+				word |= ~0ULL << (end % 64);
+			}
+			if (word == ~0ULL) {
+				run = 0;
+				continue;
+			}
+			uint32_t bit = 0;
+			while (bit < 64) {
+				uint64_t rest = word >> bit;
+				if (rest & 1) {
+					// Skip used pages
+					run = 0;
+					uint64_t free = ~rest;
+					bit += (free == 0) ? 64 - bit : __builtin_ctzll(free);
+					continue;
+				}
+				uint32_t len = (rest == 0) ? 64 - bit : __builtin_ctzll(rest);
+				if (run == 0) {
+					start = w * 64 + bit;
+				}
+				run += len;
+				if (run >= n) {
+					return start;
+				}
+				bit += len;
+			}
+		}
 	}
-	this->m_SwapFreeListHead = this->m_SwapFreeList[pageNum];
+	return UINT32_MAX;
+}
+
+// Mark swap pages from first to first + n - 1 of device dev as used. Called with m_Mtx locked
+void FreeSpaceManager::markSwapRun(uint32_t dev, uint32_t first, uint32_t n) {
+	while (n > 0) {
+		uint32_t bit = first % 64;
+		uint32_t len = (64 - bit < n) ? 64 - bit : n;
+		uint64_t mask = (len == 64) ? ~0ULL : ((1ULL << len) - 1) << bit;
+		m_SwapBitmap[first / 64] |= mask;
+		first += len;
+		n -= len;
+	}
+	if (first == m_SwapDevs[dev].first + m_SwapDevs[dev].pages) {
+		first = m_SwapDevs[dev].first;
+	}
+	m_SwapDevs[dev].rover = first;
+}
+
+/*
+   Allocate n consecutive swap pages on single device.
+   Devices are tried in order of priority. Among devices of equal priority
+   allocation starts at the device following the one used last time,
+   so that consecutive runs are striped over them.
+   Called with m_Mtx locked.
+   Return value: first swap page of run or UINT32_MAX
+*/
+uint32_t FreeSpaceManager::allocateSwapRun(uint32_t n) {
+	uint32_t groupEnd;
+	for (uint32_t group = 0; group < m_SwapDevNum; group = groupEnd) {
+		groupEnd = group + 1;
+		while (groupEnd < m_SwapDevNum && m_SwapDevs[groupEnd].priority == m_SwapDevs[group].priority) {
+			groupEnd++;
+		}
+		uint32_t count = groupEnd - group;
+		for (uint32_t k = 0; k < count; k++) {
+			uint32_t dev = group + (m_SwapStripe[group] + k) % count;
+			uint32_t first = findSwapRun(dev, n);
+			if (first != UINT32_MAX) {
+				markSwapRun(dev, first, n);
+				m_SwapStripe[group] = (dev - group + 1) % count;
+				return first;
+			}
+		}
+	}
+	return UINT32_MAX;
+}
+
+// Take free swap page
+uint32_t FreeSpaceManager::allocateSwapPage(void) {
+	pthread_mutex_lock(&m_Mtx);
+	uint32_t pageNum = allocateSwapRun(1);
+	pthread_mutex_unlock(&m_Mtx);
 	return pageNum;
 }
 
-// Return pageNum to head of swap free list
+/*
+   Take n free swap pages. Pages are allocated as contiguous run if possible,
+   so that pages evicted together are written sequentially.
+   Exit if swap is full
+*/
+void FreeSpaceManager::allocateSwapPages(uint32_t n, uint32_t* pages) {
+	pthread_mutex_lock(&m_Mtx);
+	uint32_t first = allocateSwapRun(n);
+	if (first != UINT32_MAX) {
+		for (uint32_t i = 0; i < n; i++) {
+			pages[i] = first + i;
+		}
+		pthread_mutex_unlock(&m_Mtx);
+		return;
+	}
+	// Swap is fragmented, take pages one by one
+	for (uint32_t i = 0; i < n; i++) {
+		pages[i] = allocateSwapRun(1);
+		if (pages[i] == UINT32_MAX) {
+			cerr << "No space in swap";
+			exit(1);
+		}
+	}
+	pthread_mutex_unlock(&m_Mtx);
+}
+
+// Mark pageNum as free in swap bitmap
 void FreeSpaceManager::freeSwapPage(uint32_t pageNum) {
-	this->m_SwapFreeList[pageNum] = this->m_SwapFreeListHead;
-	this->m_SwapFreeListHead = pageNum;
+	assert(pageNum < m_SwapPageNum);
+	pthread_mutex_lock(&m_Mtx);
+	assert(m_SwapBitmap[pageNum / 64] & (1ULL << (pageNum % 64)));
+	m_SwapBitmap[pageNum / 64] &= ~(1ULL << (pageNum % 64));
+	pthread_mutex_unlock(&m_Mtx);
 }
 
 // Save pageNum into empty slot of array m_PageDirs.
 // PageNum is page for page directory
 // Used when process begins
-void FreeSpaceManager::savePageDir(uint32_t pageNum) {
+// Return value: slot index or -1 if all slots are taken
+int FreeSpaceManager::savePageDir(uint32_t pageNum) {
+	int slot = -1;
+	pthread_mutex_lock(&m_PageDirUsedMtx);
 	for (unsigned i = 0; i < PROCESS_MAX; i++) {
-		if (m_PageDirs[i] == 0) {
-			m_PageDirs[i] = pageNum;
+		if (!m_PageDirUsed[i]) {
+			m_PageDirUsed[i] = true;
+			slot = i;
 			break;
 		}
 	}
+	pthread_mutex_unlock(&m_PageDirUsedMtx);
+	if (slot == -1) {
+		return slot;
+	}
+	lockPageDir(slot);
+	m_PageDirs[slot] = pageNum;
+	m_Resident[slot] = 0;
+	m_Swapped[slot] = 0;
+	unlockPageDir(slot);
+	return slot;
 }
 
-//  Find slot containing pageNum and write 0 into it.
-//  Used when process terminates
-void FreeSpaceManager::freePageDirs(uint32_t pageNum) {
+// Return slot of m_PageDirs containing pageNum
+int FreeSpaceManager::findPageDir(uint32_t pageNum) {
 	for (unsigned i = 0; i < PROCESS_MAX; i++) {
-		if (m_PageDirs[i] == pageNum) {
-			m_PageDirs[i] = 0;
-			break;
+		lockPageDir(i);
+		bool found = m_PageDirs[i] == pageNum;
+		unlockPageDir(i);
+		if (found) {
+			return i;
 		}
 	}
+	return -1;
+}
+
+//  Write 0 into slot and free the page directory page.
+//  Used when process terminates
+void FreeSpaceManager::freePageDirs(int slot) {
+	lockPageDir(slot);
+	uint32_t pageNum = m_PageDirs[slot];
+	m_PageDirs[slot] = 0;
+	unlockPageDir(slot);
+	pthread_mutex_lock(&m_PageDirUsedMtx);
+	m_PageDirUsed[slot] = false;
+	pthread_mutex_unlock(&m_PageDirUsedMtx);
+	freePage(pageNum);
 }
 
 /* Args:
 	isForPageDir: true if page is allocated for page directory
    If there is free page in memory free page list, return it.	
    If free list is empty, look for swappable page(not page table), swap it out and return it.
+   Page directory page is returned zeroed and registered in m_PageDirs.
+   Must not be called with any address space locked.
 */      
 uint32_t FreeSpaceManager::allocatePage(bool isForPageDir) {
-	uint32_t pageNum = this->m_MemFreeListHead;
-	if (pageNum != UINT32_MAX) {
-		// There is free page
-		this->m_MemFreeListHead = this->m_MemFreeList[pageNum];
-		if (isForPageDir) {
-			savePageDir(pageNum);
+	pthread_mutex_lock(&m_Mtx);
+	uint32_t pageNum = m_Frames.allocate(0);
+	pthread_mutex_unlock(&m_Mtx);
+	if (pageNum == UINT32_MAX) {
+		// There is no free page. Find page candidate for swapping out
+		pageNum = reclaimPages();
+		if (pageNum == UINT32_MAX) {
+			return pageNum;
 		}
-		return pageNum;
 	}
-	// There is no free page. Find page candidate for swapping out
-	for (unsigned i = 0; i < PROCESS_MAX; i++) {
-		if (m_PageDirs[i] == 0) {
-			continue;
+	if (isForPageDir) {
+		memset(m_Mem + pageNum * CCPU::PAGE_SIZE, 0, CCPU::PAGE_SIZE);
+		if (savePageDir(pageNum) == -1) {
+			freePage(pageNum);
+			return UINT32_MAX;
 		}
-		struct pte* pde = (struct pte*)((uint8_t*)m_MemFreeList + m_PageDirs[i] * CCPU::PAGE_SIZE);
-		for (unsigned k = 0; k < CCPU::PAGE_SIZE / sizeof(pde[0]); k++) {
-			if (!pde[k].present) {
-				continue;
-			}
-			struct pte* pte = (struct pte*)((uint8_t*)m_MemFreeList + pde[k].frameNumber * CCPU::PAGE_SIZE);
-			for (unsigned l = 0; l < CCPU::PAGE_SIZE / sizeof(pte[0]); l++) {
-				if (!pte[l].present) {
+	}
+	return pageNum;
+}
+
+/*
+   Take up to n pages at once. Pages missing on free list are reclaimed in batches.
+   Must not be called with any address space locked.
+   Return value: number of pages stored into pages
+*/
+uint32_t FreeSpaceManager::allocatePages(uint32_t n, uint32_t* pages) {
+	uint32_t got = 0;
+	while (got < n) {
+		pthread_mutex_lock(&m_Mtx);
+		while (got < n && (pages[got] = m_Frames.allocate(0)) != UINT32_MAX) {
+			got++;
+		}
+		pthread_mutex_unlock(&m_Mtx);
+		if (got == n) {
+			break;
+		}
+		uint32_t pageNum = reclaimPages();
+		if (pageNum == UINT32_MAX) {
+			break;
+		}
+		pages[got++] = pageNum;
+	}
+	return got;
+}
+
+/*
+   Collect up to m_ReclaimBatch present pages, swap them out, return first of
+   their frames and put the rest on mem free list.
+   Scan continues where previous pass stopped.
+   Victim ptes are marked inFlight until their write completes, so that fault on
+   them waits. Swap pages are allocated and written with no lock held.
+   If only pages in flight could be evicted, waits for their transfers to end
+   and takes a freed frame or scans again.
+   If there is nothing to evict, free list is checked again: exiting process
+   can free its pages while address spaces are scanned.
+   Return value: frame number or UINT32_MAX if there is nothing to evict
+*/
+uint32_t FreeSpaceManager::reclaimPages(void) {
+	struct pte* victims[RECLAIM_BATCH];
+	int victimSlots[RECLAIM_BATCH];
+	uint32_t frames[RECLAIM_BATCH];
+	uint32_t swapPages[RECLAIM_BATCH];
+	uint32_t n = 0;
+
+	pthread_mutex_lock(&m_ReclaimMtx);
+	while (true) {
+		pthread_mutex_lock(&m_InFlightMtx);
+		uint32_t gen = m_InFlightGen;
+		pthread_mutex_unlock(&m_InFlightMtx);
+		n = scanVictims(victims, victimSlots, frames);
+		if (n > 0) {
+			inFlightBegin(n);
+			break;
+		}
+		/*
+		  All evictable pages may be in flight. Their transfers end with frames
+		  freed or pages present again, so wait for one of them and retry.
+		*/
+		pthread_mutex_lock(&m_InFlightMtx);
+		if (m_InFlight == 0 && m_InFlightGen == gen) {
+			pthread_mutex_unlock(&m_InFlightMtx);
+			break;
+		}
+		while (m_InFlightGen == gen) {
+			pthread_cond_wait(&m_InFlightCond, &m_InFlightMtx);
+		}
+		pthread_mutex_unlock(&m_InFlightMtx);
+		pthread_mutex_lock(&m_Mtx);
+		uint32_t frame = m_Frames.allocate(0);
+		pthread_mutex_unlock(&m_Mtx);
+		if (frame != UINT32_MAX) {
+			pthread_mutex_unlock(&m_ReclaimMtx);
+			return frame;
+		}
+	}
+	pthread_mutex_unlock(&m_ReclaimMtx);
+
+	if (n == 0) {
+		// Candidate for swap out not found, take page freed meanwhile if any
+		pthread_mutex_lock(&m_Mtx);
+		uint32_t pageNum = m_Frames.allocate(0);
+		pthread_mutex_unlock(&m_Mtx);
+		return pageNum;
+	}
+
+	allocateSwapPages(n, swapPages);
+	for (uint32_t i = 0; i < n; i++) {
+		writePage(frames[i], swapPages[i]);
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		lockPageDir(victimSlots[i]);
+		victims[i]->frameNumber = swapPages[i];
+		victims[i]->swaped = 1;
+		victims[i]->inFlight = 0;
+		m_Swapped[victimSlots[i]]++;
+		wakePageDir(victimSlots[i]);
+		unlockPageDir(victimSlots[i]);
+	}
+
+	freePages(n - 1, frames + 1);
+	inFlightEnd(n);
+	return frames[0];
+}
+
+/*
+   Reserve pins of n frames for pages which get locked.
+   Return value: false if more than m_PinMax frames would be pinned
+*/
+bool FreeSpaceManager::reservePins(uint32_t n) {
+	pthread_mutex_lock(&m_Mtx);
+	bool res = n <= m_PinMax - m_Pinned;
+	if (res) {
+		m_Pinned += n;
+	}
+	pthread_mutex_unlock(&m_Mtx);
+	return res;
+}
+
+// Pages were unlocked or their reserved pins were not used
+void FreeSpaceManager::releasePins(uint32_t n) {
+	pthread_mutex_lock(&m_Mtx);
+	assert(n <= m_Pinned);
+	m_Pinned -= n;
+	pthread_mutex_unlock(&m_Mtx);
+}
+
+// Count pages whose swap transfer starts
+void FreeSpaceManager::inFlightBegin(uint32_t n) {
+	pthread_mutex_lock(&m_InFlightMtx);
+	m_InFlight += n;
+	pthread_mutex_unlock(&m_InFlightMtx);
+}
+
+// Transfers are done and their frames freed or pages present, wake waiting reclaim
+void FreeSpaceManager::inFlightEnd(uint32_t n) {
+	pthread_mutex_lock(&m_InFlightMtx);
+	m_InFlight -= n;
+	m_InFlightGen++;
+	pthread_cond_broadcast(&m_InFlightCond);
+	pthread_mutex_unlock(&m_InFlightMtx);
+}
+
+/*
+   Called with m_ReclaimMtx locked.
+   Collect up to m_ReclaimBatch present pages which are not locked and mark
+   them inFlight. Scan continues where previous one stopped.
+   Lock of address space is held for one page table at a time, so that
+   accesses of its process are not stalled for the whole scan.
+   Return value: number of victims
+*/
+uint32_t FreeSpaceManager::scanVictims(struct pte** victims, int* victimSlots, uint32_t* frames) {
+	uint32_t n = 0;
+	uint32_t slot = m_ReclaimSlot;
+	uint32_t firstPde = m_ReclaimPde;
+	// PROCESS_MAX + 1 passes, so that start slot is also scanned below firstPde
+	for (unsigned i = 0; i <= PROCESS_MAX && n < m_ReclaimBatch; i++) {
+		lockPageDir(slot);
+		if (m_PageDirs[slot] != 0) {
+			uint32_t k;
+			for (k = firstPde; k < CCPU::PAGE_DIR_ENTRIES && n < m_ReclaimBatch && m_PageDirs[slot] != 0; k++) {
+				// Directory is looked up again, lock was released after previous page table
+				struct pte* pde = (struct pte*)(m_Mem + m_PageDirs[slot] * CCPU::PAGE_SIZE);
+				if (!pde[k].present) {
 					continue;
 				}
-				// Found candidate for swapping out
-				pageNum = pte[l].frameNumber;
-				uint32_t swapPageNum = allocateSwapPage();
-				if (swapPageNum == UINT32_MAX) {
-					cerr << "No space in swap";
-					exit(1);
-				}
-				m_writePage(pageNum, swapPageNum);
-				pte[l].present = 0;
-				pte[l].frameNumber = swapPageNum;
-				pte[l].swaped = 1;
-				if (isForPageDir) {
-					savePageDir(pageNum);
+				struct pte* pte = (struct pte*)(m_Mem + pde[k].frameNumber * CCPU::PAGE_SIZE);
+				for (unsigned l = 0; l < CCPU::PAGE_SIZE / sizeof(pte[0]) && n < m_ReclaimBatch; l++) {
+					if (!pte[l].present || pte[l].locked) {
+						continue;
+					}
+					// Found candidate for swapping out
+					pte[l].present = 0;
+					pte[l].inFlight = 1;
+					m_Resident[slot]--;
+					victims[n] = &pte[l];
+					victimSlots[n] = slot;
+					frames[n] = pte[l].frameNumber;
+					n++;
 				}
-				return pageNum;
+				// Let the process run between page tables
+				unlockPageDir(slot);
+				lockPageDir(slot);
 			}
+			m_ReclaimSlot = slot;
+			m_ReclaimPde = k;
 		}
+		unlockPageDir(slot);
+		firstPde = 0;
+		slot = (slot + 1) % PROCESS_MAX;
 	}
-
-	// Candidate for swap out not found.
-	return UINT32_MAX;
+	return n;
 }
 
 /* 
   Args:
      pageNum - page to be freed
-  Return pageNum into head of mem free list
-  Free slot in m_PageDirs if pageNum is found in it. 
+  Return pageNum into buddy system
+  Page directories are released by freePageDirs
 */
 void FreeSpaceManager::freePage(uint32_t pageNum) {
 	assert(pageNum < this->m_PageNum);
-	this->m_MemFreeList[pageNum] = this->m_MemFreeListHead;
-	this->m_MemFreeListHead = pageNum;
-	for (unsigned i = 0; i < PROCESS_MAX; i++) {
-		if (m_PageDirs[i] == pageNum) {
-			m_PageDirs[i] = 0;
+	pthread_mutex_lock(&m_Mtx);
+	m_Frames.free(pageNum, 0);
+	pthread_mutex_unlock(&m_Mtx);
+}
+
+// Return n pages into buddy system under one lock
+void FreeSpaceManager::freePages(uint32_t n, const uint32_t* pages) {
+	pthread_mutex_lock(&m_Mtx);
+	for (uint32_t i = 0; i < n; i++) {
+		assert(pages[i] < this->m_PageNum);
+		m_Frames.free(pages[i], 0);
+	}
+	pthread_mutex_unlock(&m_Mtx);
+}
+
+/* Args:
+	order - block of 1 << order contiguous frames is requested
+   When no free block is large enough, pages are migrated out of some block.
+   If there are not enough free frames to migrate them to, pages are swapped
+   out batch by batch until compaction succeeds or nothing can be evicted.
+   Must not be called with any address space locked.
+   Return value: first frame of block or UINT32_MAX
+*/
+uint32_t FreeSpaceManager::allocateFrames(uint32_t order) {
+	if (order >= FRAME_ORDERS || (1U << order) > m_PageNum) {
+		return UINT32_MAX;
+	}
+	pthread_mutex_lock(&m_Mtx);
+	uint32_t frame = m_Frames.allocate(order);
+	pthread_mutex_unlock(&m_Mtx);
+	while (frame == UINT32_MAX) {
+		frame = compactFrames(order);
+		if (frame != UINT32_MAX) {
+			break;
+		}
+		// Moved pages need free frames, swap out one batch and try again
+		uint32_t pageNum = reclaimPages();
+		if (pageNum == UINT32_MAX) {
 			break;
 		}
+		freePage(pageNum);
 	}
+	return frame;
+}
+
+void FreeSpaceManager::freeFrames(uint32_t frame, uint32_t order) {
+	assert(frame + (1U << order) <= this->m_PageNum);
+	pthread_mutex_lock(&m_Mtx);
+	m_Frames.free(frame, order);
+	pthread_mutex_unlock(&m_Mtx);
+}
+
+/*
+   Called with address space slot locked.
+   Collect ptes of present pages of slot which are neither locked nor in flight,
+   the only pages compaction can move, whose frames are in [first, first + size).
+   Return value: number of ptes stored to ptes
+*/
+uint32_t FreeSpaceManager::movablePages(uint32_t slot, uint32_t first, uint32_t size, struct pte** ptes) {
+	uint32_t n = 0;
+	if (m_PageDirs[slot] == 0) {
+		return 0;
+	}
+	struct pte* pde = (struct pte*)(m_Mem + m_PageDirs[slot] * CCPU::PAGE_SIZE);
+	for (unsigned k = 0; k < CCPU::PAGE_DIR_ENTRIES; k++) {
+		if (!pde[k].present) {
+			continue;
+		}
+		struct pte* pte = (struct pte*)(m_Mem + pde[k].frameNumber * CCPU::PAGE_SIZE);
+		for (unsigned l = 0; l < CCPU::PAGE_SIZE / sizeof(pte[0]); l++) {
+			if (pte[l].present && !pte[l].locked && !pte[l].inFlight &&
+			    pte[l].frameNumber - first < size) {
+				ptes[n++] = &pte[l];
+			}
+		}
+	}
+	return n;
+}
+
+/*
+   Find aligned block of 1 << order frames whose frames are free or hold movable
+   pages: present pages of address spaces which are neither locked nor in flight.
+   Page tables, page directories and frames held outside of page tables are not
+   movable. Pages of the block with the fewest of them are copied to free frames
+   outside of the block and their ptes are updated.
+   Address spaces are locked one at a time, first to find owners of frames, then
+   to move pages of owners of the block. Free parts of the block are taken out of
+   free lists before, so frames freed meanwhile are the only ones which can join.
+   If a frame of block is still in use at the end, e.g. its page got locked, the
+   block is given back.
+   Return value: first frame of block or UINT32_MAX
+*/
+uint32_t FreeSpaceManager::compactFrames(uint32_t order) {
+	uint32_t size = 1U << order;
+	pthread_mutex_lock(&m_ReclaimMtx);
+	pthread_mutex_lock(&m_Mtx);
+	// Block could have been freed meanwhile
+	uint32_t first = m_Frames.allocate(order);
+	pthread_mutex_unlock(&m_Mtx);
+	if (first != UINT32_MAX) {
+		pthread_mutex_unlock(&m_ReclaimMtx);
+		return first;
+	}
+
+	// Slot + 1 of address space whose movable page is in frame, 0 if none
+	uint8_t* owner = new uint8_t[m_PageNum]();
+	struct pte** ptes = new struct pte*[m_PageNum];
+	for (uint32_t slot = 0; slot < PROCESS_MAX; slot++) {
+		lockPageDir(slot);
+		uint32_t n = movablePages(slot, 0, m_PageNum, ptes);
+		for (uint32_t i = 0; i < n; i++) {
+			owner[ptes[i]->frameNumber] = slot + 1;
+		}
+		unlockPageDir(slot);
+	}
+
+	pthread_mutex_lock(&m_Mtx);
+	uint32_t bestMoves = UINT32_MAX;
+	for (uint32_t block = 0; block + size <= m_PageNum; block += size) {
+		uint32_t moves = 0;
+		uint32_t frame = block;
+		while (frame < block + size) {
+			uint8_t freeOrder = m_Frames.freeOrder(frame);
+			if (freeOrder != FRAME_NOT_FREE) {
+				// Free block inside of block, it is not larger as allocation failed
+				frame += 1U << freeOrder;
+			} else if (owner[frame] != 0) {
+				moves++;
+				frame++;
+			} else {
+				break;
+			}
+		}
+		// Moved pages need free frames outside of block
+		if (frame == block + size && moves < bestMoves &&
+		    m_Frames.freeFrames() - (size - moves) >= moves) {
+			first = block;
+			bestMoves = moves;
+		}
+	}
+	if (first == UINT32_MAX) {
+		pthread_mutex_unlock(&m_Mtx);
+		delete[] ptes;
+		delete[] owner;
+		pthread_mutex_unlock(&m_ReclaimMtx);
+		return UINT32_MAX;
+	}
+	// Frames of block taken out of free lists or vacated by moves
+	bool* held = new bool[size]();
+	for (uint32_t frame = first; frame < first + size; ) {
+		uint8_t freeOrder = m_Frames.freeOrder(frame);
+		if (freeOrder != FRAME_NOT_FREE) {
+			m_Frames.remove(frame, freeOrder);
+			for (uint32_t i = 0; i < 1U << freeOrder; i++) {
+				held[frame - first + i] = true;
+			}
+			frame += 1U << freeOrder;
+		} else {
+			frame++;
+		}
+	}
+	pthread_mutex_unlock(&m_Mtx);
+
+	bool res = true;
+	for (uint32_t slot = 0; slot < PROCESS_MAX && res; slot++) {
+		bool owns = false;
+		for (uint32_t i = 0; i < size; i++) {
+			owns = owns || owner[first + i] == slot + 1;
+		}
+		if (!owns) {
+			continue;
+		}
+		lockPageDir(slot);
+		uint32_t n = movablePages(slot, first, size, ptes);
+		pthread_mutex_lock(&m_Mtx);
+		for (uint32_t i = 0; i < n && res; i++) {
+			uint32_t target = m_Frames.allocate(0);
+			res = target != UINT32_MAX;
+			if (res) {
+				memcpy(m_Mem + target * CCPU::PAGE_SIZE, m_Mem + ptes[i]->frameNumber * CCPU::PAGE_SIZE, CCPU::PAGE_SIZE);
+				held[ptes[i]->frameNumber - first] = true;
+				ptes[i]->frameNumber = target;
+			}
+		}
+		pthread_mutex_unlock(&m_Mtx);
+		unlockPageDir(slot);
+	}
+	delete[] ptes;
+	delete[] owner;
+
+	pthread_mutex_lock(&m_Mtx);
+	for (uint32_t frame = first; frame < first + size && res; frame++) {
+		uint8_t freeOrder = m_Frames.freeOrder(frame);
+		if (!held[frame - first] && freeOrder != FRAME_NOT_FREE) {
+			// Freed meanwhile, buddy of it in block is not free, so it did not merge outside
+			m_Frames.remove(frame, freeOrder);
+			for (uint32_t i = 0; i < 1U << freeOrder; i++) {
+				held[frame - first + i] = true;
+			}
+		}
+		res = held[frame - first];
+	}
+	if (!res) {
+		for (uint32_t i = 0; i < size; i++) {
+			if (held[i]) {
+				m_Frames.free(first + i, 0);
+			}
+		}
+		first = UINT32_MAX;
+	}
+	pthread_mutex_unlock(&m_Mtx);
+	delete[] held;
+	pthread_mutex_unlock(&m_ReclaimMtx);
+	return first;
 }
 
 /*
     For debugging
 */
 void FreeSpaceManager::printFreeList() {
-	uint32_t cur = this->m_MemFreeListHead;
-	while (cur != UINT32_MAX) {
-		cout << cur << ", ";
-		cur = this->m_MemFreeList[cur];
-	}
-	cout << "\n";
-	cur = this->m_SwapFreeListHead;
-	cout << "head " << cur << "; " << "SwapFreeList:\n";
-	while (cur != UINT32_MAX) {
-		cout << cur << ", ";
-		cur = this->m_SwapFreeList[cur];
+	m_Frames.print();
+	cout << "Free swap pages:\n";
+	for (uint32_t i = 0; i < m_SwapPageNum; i++) {
+		if (!(m_SwapBitmap[i / 64] & (1ULL << (i % 64)))) {
+			cout << i << ", ";
+		}
 	}
 	cout << "\n";
 }
 
+
 /*
   Allocated dynamically by memMgr
 */
 FreeSpaceManager* g_FSMan;
 
+/*
+  Number of running processes started by newProcess.
+  memMgr waits for it to drop to zero before it destroys g_FSMan
+*/
+pthread_mutex_t g_ProcMtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_ProcCond = PTHREAD_COND_INITIALIZER;
+int g_ProcCount;
+
 class CMM : public CCPU
 {
 public:
 	/**
 	 * constructor
-	 * Set all slots of page directory as not-present
+	 * Page directory is zeroed by FreeSpaceManager::allocatePage
 	 */
 	CMM( uint8_t * memStart, uint32_t  pageTableRoot ): CCPU(memStart, pageTableRoot) {
-		struct pte* pageDirPte = (struct pte*)(m_MemStart + m_PageTableRoot);
-		for (unsigned i = 0; i < CCPU::PAGE_SIZE / sizeof (struct pte); i++) {
-			pageDirPte[i].present = 0;
-		}
+		m_ReserveNum = 0;
+		m_TableNum = 0;
+		memset(m_Tables, 0, sizeof(m_Tables));
+		memset(m_TableLive, 0, sizeof(m_TableLive));
+		m_Slot = g_FSMan->findPageDir(m_PageTableRoot / CCPU::PAGE_SIZE);
+		assert(m_Slot != -1);
 	}
 
 	/**
 	 * destructor
 	 *
 	 * free all memory and swap pages
+	 * Only present page tables are visited, each of them up to its last used pte.
+	 * Frames are collected and returned to FreeSpaceManager by one call.
+	 * They are counted as in flight until then, so that reclaim which finds
+	 * nothing to evict waits for them instead of failing.
 	 */
 	~CMM() {
 		struct pte* pageDirPte = (struct pte*)(m_MemStart + m_PageTableRoot);
-		for (unsigned i = 0; i < CCPU::PAGE_SIZE / sizeof (struct pte); i++) {
-			if (pageDirPte[i].present) {
+		g_FSMan->lockPageDir(m_Slot);
+		// Reclaim can only lower number of resident pages meanwhile
+		uint32_t framesMax = g_FSMan->residentPages(m_Slot) + m_TableNum;
+		uint32_t* frames = new uint32_t[framesMax];
+		g_FSMan->inFlightBegin(framesMax);
+		uint32_t n = 0;
+		uint32_t pinned = 0;
+		for (unsigned w = 0; w < TABLE_WORDS; w++) {
+			while (m_Tables[w] != 0) {
+				unsigned i = w * 32 + __builtin_ctz(m_Tables[w]);
+				m_Tables[w] &= m_Tables[w] - 1;
 				struct pte *pageTablePte = (struct pte*)(m_MemStart + pageDirPte[i].frameNumber * CCPU::PAGE_SIZE);
-				for (unsigned j = 0; j < CCPU::PAGE_SIZE / sizeof (struct pte); j++) {
+				for (unsigned j = 0; m_TableLive[i] > 0; j++) {
+					while (pageTablePte[j].inFlight) {
+						/* page is being swapped out by other process */
+						g_FSMan->waitPageDir(m_Slot);
+					}
+					/* ptes are cleared, so that reclaim does not take them while we wait */
 					if (pageTablePte[j].present) {
 						/* free address space page */
-						g_FSMan->freePage(pageTablePte[j].frameNumber);
-					}
-					if (pageTablePte[j].swaped) {
+						frames[n++] = pageTablePte[j].frameNumber;
+						pageTablePte[j].present = 0;
+						if (pageTablePte[j].locked > 0) {
+							pageTablePte[j].locked = 0;
+							pinned++;
+						}
+						g_FSMan->countPages(m_Slot, -1, 0);
+						m_TableLive[i]--;
+					} else if (pageTablePte[j].swaped) {
 						/* free swap page */
 						g_FSMan->freeSwapPage(pageTablePte[j].frameNumber);
+						pageTablePte[j].swaped = 0;
+						g_FSMan->countPages(m_Slot, 0, -1);
+						m_TableLive[i]--;
 					}
 				}
 				/* free level 2 page table */
-				g_FSMan->freePage(pageDirPte[i].frameNumber);
+				frames[n++] = pageDirPte[i].frameNumber;
+				pageDirPte[i].present = 0;
 			}
 		}
+		assert(g_FSMan->residentPages(m_Slot) == 0 && g_FSMan->swappedPages(m_Slot) == 0);
+		g_FSMan->unlockPageDir(m_Slot);
+		g_FSMan->releasePins(pinned);
+		g_FSMan->freePages(n, frames);
+		g_FSMan->inFlightEnd(framesMax);
+		delete[] frames;
 
 		/* free level 1 page directory */
-		g_FSMan->freePage(m_PageTableRoot / CCPU::PAGE_SIZE);
+		g_FSMan->freePageDirs(m_Slot);
 	}
 
 	virtual bool             newProcess                    ( void            * processArg,
 								 void           (* entryPoint) ( CCPU *, void * ) ) override;
+	virtual bool             populate                      ( uint32_t          address,
+								 uint32_t          length,
+								 bool              write ) override;
+	virtual bool             lock                          ( uint32_t          address,
+								 uint32_t          length ) override;
+	virtual bool             unlock                        ( uint32_t          address,
+								 uint32_t          length ) override;
 protected:
 	virtual bool             pageFaultHandler              ( uint32_t          address,
 								 bool              write ) override;
-	/*
-	  optionally:
-
-	  virtual void             memAccessStart                ( void ) override;
-	  virtual void             memAccessEnd                  ( void ) override;
-	*/
+	virtual void             memAccessStart                ( void ) override;
+	virtual void             memAccessEnd                  ( void ) override;
 
 private:
+	uint32_t allocatePage(void);
+	bool populateRange(uint32_t address, uint32_t length, bool write, bool pin);
+	struct pte* findPte(uint32_t address);
+	// Slot of page directory in FreeSpaceManager::m_PageDirs
+	int m_Slot;
+	// Frames taken in advance by populate, used by page faults before free list
+	uint32_t m_Reserve[RECLAIM_BATCH];
+	uint32_t m_ReserveNum;
+	// Bit per present page table, so that teardown skips empty page directory entries
+	static const unsigned TABLE_WORDS = CCPU::PAGE_DIR_ENTRIES / 32;
+	uint32_t m_Tables[TABLE_WORDS];
+	uint32_t m_TableNum;
+	// Number of ptes of page table which are present, swapped or in flight
+	uint16_t m_TableLive[CCPU::PAGE_DIR_ENTRIES];
 };
 
+struct processStart {
+	CMM* mm;
+	void* arg;
+	void (*entryPoint)(CCPU*, void*);
+};
+
+static void* processThread(void* arg)
+{
+	struct processStart* ps = (struct processStart*)arg;
+	ps->entryPoint(ps->mm, ps->arg);
+	delete ps->mm;
+	delete ps;
+
+	pthread_mutex_lock(&g_ProcMtx);
+	g_ProcCount--;
+	pthread_cond_broadcast(&g_ProcCond);
+	pthread_mutex_unlock(&g_ProcMtx);
+	return nullptr;
+}
+
+/*
+  Create address space for new process and run entryPoint in new thread.
+  Return value:
+     false if there is no memory for page directory or no free process slot
+*/
 bool CMM::newProcess( void * processArg, void  (* entryPoint) ( CCPU *, void * ))
 {
+	uint32_t pTable = g_FSMan->allocatePage(true);
+	if (pTable == UINT32_MAX) {
+		return false;
+	}
+	struct processStart* ps = new processStart;
+	ps->mm = new CMM(m_MemStart, pTable * CCPU::PAGE_SIZE);
+	ps->arg = processArg;
+	ps->entryPoint = entryPoint;
+
+	pthread_mutex_lock(&g_ProcMtx);
+	g_ProcCount++;
+	pthread_mutex_unlock(&g_ProcMtx);
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, processThread, ps) != 0) {
+		pthread_attr_destroy(&attr);
+		pthread_mutex_lock(&g_ProcMtx);
+		g_ProcCount--;
+		pthread_mutex_unlock(&g_ProcMtx);
+		delete ps->mm;
+		delete ps;
+		return false;
+	}
+	pthread_attr_destroy(&attr);
 	return true;
 }
 
+/*
+  Address space is locked for the whole memory access, so that
+  reclaim cannot evict page between translation and access.
+*/
+void CMM::memAccessStart(void)
+{
+	g_FSMan->lockPageDir(m_Slot);
+}
+
+void CMM::memAccessEnd(void)
+{
+	g_FSMan->unlockPageDir(m_Slot);
+}
+
+/*
+  Take frame reserved by populate, if any. Otherwise allocate frame with
+  address space unlocked, so that reclaim can evict pages of this process meanwhile.
+  Called with address space locked, returns with address space locked.
+*/
+uint32_t CMM::allocatePage(void)
+{
+	if (m_ReserveNum > 0) {
+		return m_Reserve[--m_ReserveNum];
+	}
+	g_FSMan->unlockPageDir(m_Slot);
+	uint32_t frameNum = g_FSMan->allocatePage(false);
+	g_FSMan->lockPageDir(m_Slot);
+	return frameNum;
+}
+
 /*
   Args:
      address - virtual address,
      write - access flag
   Return value:
-     true if success
+     true if success, false if no frame is left for page table or page:
+     nothing can be evicted, e.g. the rest of memory is locked
 
   Allocates level2 page table if necessary, allocates address space page if necessary.
   If page is swapped, read it from swap space.
+  Called with address space locked. Swap read is done with address space unlocked,
+  pte is marked inFlight meanwhile.
 */
 bool CMM::pageFaultHandler(uint32_t address, bool write)
 {
@@ -333,20 +1291,20 @@ bool CMM::pageFaultHandler(uint32_t address, bool write)
 
 	if (pageDirPte[level1index].present == 0) {
 		// Level2 pageTable is not present
-		uint32_t frameNum = g_FSMan->allocatePage(false);
+		uint32_t frameNum = allocatePage();
 		if (frameNum == UINT32_MAX) {
-			cerr << "Fail to allocate page for level2 page table\n";
-			exit(1);
+			return false;
 		}
+		pageTablePte = (struct pte*)(m_MemStart + frameNum * CCPU::PAGE_SIZE);
+		// Mark all ptes as not present
+		memset(pageTablePte, 0, CCPU::PAGE_SIZE);
 		pageDirPte[level1index].present = 1;
 		pageDirPte[level1index].bitU = 1;
-		pageDirPte[level1index].bitW = write;
+		// Access rights are checked on level2, page table covers writable pages too
+		pageDirPte[level1index].bitW = 1;
 		pageDirPte[level1index].frameNumber = frameNum;
-		pageTablePte = (struct pte*)(m_MemStart + frameNum * CCPU::PAGE_SIZE);
-		// Mark all ptes as not present
-		for (unsigned i = 0; i < CCPU::PAGE_SIZE / sizeof (struct pte); i++) {
-			pageTablePte[i].present = 0;
-		}
+		m_Tables[level1index / 32] |= 1U << (level1index % 32);
+		m_TableNum++;
 	} else {
 		//  Level2 pageTable is present
 		pageTablePte = (struct pte*)(m_MemStart + pageDirPte[level1index].frameNumber * CCPU::PAGE_SIZE);
@@ -355,34 +1313,213 @@ bool CMM::pageFaultHandler(uint32_t address, bool write)
 	// Level2 pageTable
 	// Level2 index is in from 12 to 21 bits
 	int level2index = a.bits.pageTableIndex;
-	if (pageTablePte[level2index].present == 0) {
+	struct pte* pte = &pageTablePte[level2index];
+	if (pte->present == 0) {
 		// Virtual page is not present in main memory
-		uint32_t frameNum = g_FSMan->allocatePage(false);
+		bool swapIn = false;
+		uint32_t frameNum = allocatePage();
 		if (frameNum == UINT32_MAX) {
-			cerr << "Fail to allocate page for address space\n";
-			exit(1);
+			return false;
+		}
+		while (pte->inFlight) {
+			// Page is being written to swap
+			g_FSMan->waitPageDir(m_Slot);
 		}
-		pageTablePte[level2index].present = 1;
-		pageTablePte[level2index].bitU = 1;
-		pageTablePte[level2index].bitW = write;
-		if (pageTablePte[level2index].swaped == 1) {
+		if (pte->swaped == 1) {
 			// Read page from swap space
-			g_FSMan->readPage(frameNum, pageTablePte[level2index].frameNumber);
-			pageTablePte[level2index].swaped = 0;
-			g_FSMan->freeSwapPage(pageTablePte[level2index].frameNumber);
+			uint32_t diskPage = pte->frameNumber;
+			pte->inFlight = 1;
+			g_FSMan->inFlightBegin(1);
+			g_FSMan->unlockPageDir(m_Slot);
+			g_FSMan->readPage(frameNum, diskPage);
+			g_FSMan->freeSwapPage(diskPage);
+			g_FSMan->lockPageDir(m_Slot);
+			pte->inFlight = 0;
+			pte->swaped = 0;
+			g_FSMan->countPages(m_Slot, 0, -1);
+			g_FSMan->wakePageDir(m_Slot);
+			swapIn = true;
+		} else {
+			// Fresh page, frame may hold data of evicted page
+			memset(m_MemStart + frameNum * CCPU::PAGE_SIZE, 0, CCPU::PAGE_SIZE);
+			m_TableLive[level1index]++;
+		}
+		g_FSMan->countPages(m_Slot, 1, 0);
+		pte->present = 1;
+		pte->bitU = 1;
+		pte->bitW = write;
+		pte->frameNumber = frameNum;
+		if (swapIn) {
+			// Page can be evicted again
+			g_FSMan->inFlightEnd(1);
 		}
-		pageTablePte[level2index].frameNumber = frameNum;
 	}
 
-	if (pageTablePte[level2index].bitW != write) {
-		cerr << "Write bit mismatch\n";
-		exit(1);
+	if (write && !pte->bitW) {
+		// Page was faulted in or swapped in by read, write makes it writable
+		pte->bitW = 1;
 	}
 
 	return true;
 }
 
 
+/*
+  Return pte of address or nullptr if its page table is not present.
+  Called with address space locked.
+*/
+struct pte* CMM::findPte(uint32_t address)
+{
+	union addr a;
+	a.address = address;
+	struct pte* pageDirPte = (struct pte*)(m_MemStart + m_PageTableRoot);
+	if (!pageDirPte[a.bits.pageDirIndex].present) {
+		return nullptr;
+	}
+	struct pte* pageTablePte = (struct pte*)(m_MemStart + pageDirPte[a.bits.pageDirIndex].frameNumber * CCPU::PAGE_SIZE);
+	return &pageTablePte[a.bits.pageTableIndex];
+}
+
+/*
+  Args:
+     address, length - virtual address range
+     write - access flag
+     pin - count lock of pages, so that reclaim does not select them until
+           every lock covering page is unlocked
+  Return value:
+     false if range wraps around, a page is already locked PIN_MAX times,
+     locked pages would take more than half of memory or page fault fails,
+     pages pinned by this call are unpinned then
+
+  Pages are faulted in by batches of RECLAIM_BATCH. Frames for whole batch,
+  including missing page tables, are allocated by one call and kept in m_Reserve.
+*/
+bool CMM::populateRange(uint32_t address, uint32_t length, bool write, bool pin)
+{
+	if (length == 0) {
+		return true;
+	}
+	if (address + length - 1 < address) {
+		return false;
+	}
+	uint32_t page = address & CCPU::ADDR_MASK;
+	uint32_t pages = (((address + length - 1) & CCPU::ADDR_MASK) - page) / CCPU::PAGE_SIZE + 1;
+	bool res = true;
+	uint32_t pinned = 0;
+
+	memAccessStart();
+	for (uint32_t done = 0; done < pages && res; ) {
+		uint32_t batch = (pages - done < RECLAIM_BATCH) ? pages - done : RECLAIM_BATCH;
+		// Count frames needed by batch
+		uint32_t needed = 0;
+		uint32_t lastTable = UINT32_MAX;
+		for (uint32_t i = 0; i < batch; i++) {
+			uint32_t pageAddr = page + (done + i) * CCPU::PAGE_SIZE;
+			struct pte* pte = findPte(pageAddr);
+			if (pte == nullptr && (pageAddr >> 22) != lastTable) {
+				lastTable = pageAddr >> 22;
+				needed++;
+			}
+			if (pte == nullptr || !pte->present) {
+				needed++;
+			}
+		}
+		if (needed > RECLAIM_BATCH - m_ReserveNum) {
+			needed = RECLAIM_BATCH - m_ReserveNum;
+		}
+		g_FSMan->unlockPageDir(m_Slot);
+		m_ReserveNum += g_FSMan->allocatePages(needed, m_Reserve + m_ReserveNum);
+		g_FSMan->lockPageDir(m_Slot);
+
+		for (uint32_t i = 0; i < batch && res; i++) {
+			uint32_t pageAddr = page + (done + i) * CCPU::PAGE_SIZE;
+			struct pte* pte = findPte(pageAddr);
+			// Frame is pinned by first lock of page only
+			bool newPin = pin && (pte == nullptr || pte->locked == 0);
+			if (newPin && !g_FSMan->reservePins(1)) {
+				res = false;
+				continue;
+			}
+			if (pte == nullptr || !pte->present) {
+				res = pageFaultHandler(pageAddr, write);
+				pte = findPte(pageAddr);
+			} else if (write) {
+				// Page read before stays where it is
+				pte->bitW = 1;
+			}
+			if (res && pin) {
+				if (pte->locked == PIN_MAX) {
+					res = false;
+				} else {
+					pte->locked++;
+					pinned++;
+				}
+			}
+			if (!res && newPin) {
+				g_FSMan->releasePins(1);
+			}
+		}
+		done += batch;
+	}
+	// Pages pinned so far are consecutive from page
+	uint32_t unpinned = 0;
+	for (uint32_t i = 0; !res && i < pinned; i++) {
+		if (--findPte(page + i * CCPU::PAGE_SIZE)->locked == 0) {
+			unpinned++;
+		}
+	}
+	g_FSMan->releasePins(unpinned);
+
+	// Return frames not used by faults
+	while (m_ReserveNum > 0) {
+		g_FSMan->freePage(m_Reserve[--m_ReserveNum]);
+	}
+	memAccessEnd();
+	return res;
+}
+
+bool CMM::populate(uint32_t address, uint32_t length, bool write)
+{
+	return populateRange(address, length, write, false);
+}
+
+/*
+  Populate range for writing and keep its pages resident until unlock.
+*/
+bool CMM::lock(uint32_t address, uint32_t length)
+{
+	return populateRange(address, length, true, true);
+}
+
+/*
+  Drop one lock of pages of range, page can be swapped out again when no
+  other lock covers it. Pages which are not locked are skipped.
+  Return value:
+     false if range wraps around
+*/
+bool CMM::unlock(uint32_t address, uint32_t length)
+{
+	if (length == 0) {
+		return true;
+	}
+	if (address + length - 1 < address) {
+		return false;
+	}
+	uint32_t page = address & CCPU::ADDR_MASK;
+	uint32_t pages = (((address + length - 1) & CCPU::ADDR_MASK) - page) / CCPU::PAGE_SIZE + 1;
+	uint32_t unpinned = 0;
+	memAccessStart();
+	for (uint32_t i = 0; i < pages; i++) {
+		struct pte* pte = findPte(page + i * CCPU::PAGE_SIZE);
+		if (pte != nullptr && pte->locked > 0 && --pte->locked == 0) {
+			unpinned++;
+		}
+	}
+	memAccessEnd();
+	g_FSMan->releasePins(unpinned);
+	return true;
+}
+
 void               memMgr                                  ( void            * mem,
                                                              uint32_t          memPages,
                                                              uint32_t          diskPages,
@@ -390,12 +1527,27 @@ void               memMgr                                  ( void            * m
                                                              bool           (* writePage) ( uint32_t memFrame, uint32_t diskPage ),
                                                              void            * processArg,
                                                              void           (* mainProcess) ( CCPU *, void * ) )
+{
+	CSwapDevice swapDevice;
+	swapDevice.m_Pages = diskPages;
+	swapDevice.m_Priority = 0;
+	swapDevice.m_ReadPage = readPage;
+	swapDevice.m_WritePage = writePage;
+	memMgr(mem, memPages, &swapDevice, 1, processArg, mainProcess);
+}
+
+void               memMgr                                  ( void            * mem,
+                                                             uint32_t          memPages,
+                                                             const CSwapDevice * swapDevices,
+                                                             uint32_t          swapDeviceCount,
+                                                             void            * processArg,
+                                                             void           (* mainProcess) ( CCPU *, void * ) )
 {
 	for (uint32_t i = 0; i < memPages * CCPU::PAGE_SIZE; i++) {
 		((uint8_t*)mem)[i] = 0;
 	}
 	// Create free space manager
-	g_FSMan = new FreeSpaceManager((uint8_t*)mem, memPages, diskPages, readPage, writePage);
+	g_FSMan = new FreeSpaceManager((uint8_t*)mem, memPages, swapDevices, swapDeviceCount);
 	
 	// Create instance of CCPU
 	uint32_t pTable = g_FSMan->allocatePage(true);
@@ -404,5 +1556,30 @@ void               memMgr                                  ( void            * m
 	// Start init process
 	mainProcess(mm, processArg);
 	delete mm;
+
+	// Wait for processes started by newProcess
+	pthread_mutex_lock(&g_ProcMtx);
+	while (g_ProcCount != 0) {
+		pthread_cond_wait(&g_ProcCond, &g_ProcMtx);
+	}
+	pthread_mutex_unlock(&g_ProcMtx);
 	delete g_FSMan;
 }
+
+/*
+  Args:
+     order - block of 1 << order contiguous frames is requested
+  Return value:
+     first frame of block or UINT32_MAX
+  Can be called by processes of running memMgr only.
+*/
+uint32_t           memAllocFrames                          ( uint32_t          order )
+{
+	return g_FSMan->allocateFrames(order);
+}
+
+void               memFreeFrames                           ( uint32_t          frame,
+                                                             uint32_t          order )
+{
+	g_FSMan->freeFrames(frame, order);
+}